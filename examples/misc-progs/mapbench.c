@@ -0,0 +1,143 @@
+/*
+ * mapbench.c -- time a sequential scan of a mmap'd device, and count
+ * the page faults it takes. Written to compare the scullv mapping
+ * strategies, but it works with any device (or file) that has a size.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define PREPOPULATE "/sys/module/scullv/parameters/scullv_prepopulate"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long minflt(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt + ru.ru_majflt;
+}
+
+/* Read every word, so that each page is touched at least once */
+static unsigned long scan(const unsigned long *p, size_t size)
+{
+	unsigned long sum = 0;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(*p); i++)
+		sum += p[i];
+	return sum;
+}
+
+static void set_prepopulate(const char *value)
+{
+	FILE *f = fopen(PREPOPULATE, "w");
+
+	if (!f || fputs(value, f) < 0 || fclose(f)) {
+		perror(PREPOPULATE);
+		exit(1);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mapbench [-P] [-n passes] [-m 0|1] device\n"
+		"  -P      mmap with MAP_POPULATE\n"
+		"  -n      number of passes (default 3)\n"
+		"  -m      set scullv_prepopulate before starting\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int c, fd, pass, passes = 3, flags = MAP_SHARED;
+	double t0, t1, t2, t3;
+	long f0, f1, f2, f3;
+	volatile unsigned long sum = 0;	/* so the scans aren't dropped */
+	off_t size;
+	void *addr;
+
+	while ((c = getopt(argc, argv, "Pn:m:")) != -1) {
+		switch (c) {
+		case 'P':
+			flags |= MAP_POPULATE;
+			break;
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		case 'm':
+			set_prepopulate(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		fprintf(stderr, "%s: empty, write something to it first\n",
+			argv[optind]);
+		exit(1);
+	}
+	/* the partial page at the end would SIGBUS past the data */
+	size &= ~(off_t)(getpagesize() - 1);
+
+	printf("%s: %li bytes%s\n", argv[optind], (long)size,
+	       flags & MAP_POPULATE ? ", MAP_POPULATE" : "");
+	for (pass = 0; pass < passes; pass++) {
+		f0 = minflt();
+		t0 = now();
+		addr = mmap(NULL, size, PROT_READ, flags, fd, 0);
+		if (addr == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		t1 = now();
+		f1 = minflt();
+		sum += scan(addr, size);	/* cold: faults happen here */
+		t2 = now();
+		f2 = minflt();
+		sum += scan(addr, size);	/* warm: everything is mapped */
+		t3 = now();
+		f3 = minflt();
+		munmap(addr, size);
+
+		printf("pass %i: mmap %.0f us %li faults, "
+		       "cold scan %.1f MB/s %li faults, "
+		       "warm scan %.1f MB/s %li faults\n", pass,
+		       (t1 - t0) * 1e6, f1 - f0,
+		       size / (t2 - t1) / 1e6, f2 - f1,
+		       size / (t3 - t2) / 1e6, f3 - f2);
+	}
+	close(fd);
+	return 0;
+}
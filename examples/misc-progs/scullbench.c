@@ -0,0 +1,453 @@
+/*
+ * scullbench.c -- throughput and latency of the scull devices.
+ *
+ * Drives any of the scull variants (scull, scullpipe, scullc, scullp,
+ * scullv, sculld) with a configurable block size, number of threads,
+ * access pattern and I/O style, and prints one JSON object with the
+ * bandwidth, the IOPS and the latency percentiles, so that runs can be
+ * compared by scripts.
+ *
+ * The aio style needs a file with read_iter/write_iter: the scull
+ * devices have none, so io_submit fails there with EINVAL. It is for
+ * regular files, to compare the devices against.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+enum pattern { SEQ, RANDOM, APPEND };
+enum style { RW, READV, MMAP, AIO };
+enum op { READ, WRITE, MIXED };
+
+static const char *pattern_names[] = { "seq", "random", "append" };
+static const char *style_names[] = { "rw", "readv", "mmap", "aio" };
+static const char *op_names[] = { "read", "write", "mixed" };
+
+/* Parameters, from the command line */
+static const char *device;
+static size_t block = 4096;
+static int nthreads = 1;
+static long nops = 10000;		/* per thread */
+static size_t region = 1 << 20;		/* bytes the offsets range over */
+static int niov = 4;			/* readv: segments per block */
+static int depth = 8;			/* aio: requests in flight */
+static enum pattern pattern = SEQ;
+static enum style style = RW;
+static enum op op = READ;
+
+static int seekable;			/* not true for scullpipe */
+static char *map;			/* the shared mapping, for MMAP */
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int fd;
+	int writer;
+	unsigned long long seed;
+	off_t next;			/* SEQ: next offset */
+	long done;			/* operations completed */
+	unsigned long long bytes;	/* what they actually moved */
+	unsigned long long *lat;	/* ns, one per operation */
+	char *buf;
+	int err;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* xorshift64*, good enough to scatter the offsets */
+static unsigned long long rnd(struct worker *w)
+{
+	w->seed ^= w->seed >> 12;
+	w->seed ^= w->seed << 25;
+	w->seed ^= w->seed >> 27;
+	return w->seed * 2685821657736338717ULL;
+}
+
+/* Where the next block goes; each thread walks its own slice in SEQ */
+static off_t next_offset(struct worker *w)
+{
+	size_t blocks = region / block;
+	size_t slice = blocks / nthreads ? blocks / nthreads : 1;
+	off_t start = (w->id * slice % blocks) * block;
+	off_t off;
+
+	switch (pattern) {
+	case RANDOM:
+		return (rnd(w) % blocks) * block;
+	case SEQ:
+		if (w->next < start || w->next >= start + (off_t)(slice * block)
+		    || w->next + block > region)
+			w->next = start;
+		off = w->next;
+		w->next += block;
+		return off;
+	default:
+		return 0;	/* APPEND: the driver picks it */
+	}
+}
+
+static ssize_t do_rw(struct worker *w, off_t off)
+{
+	if (!seekable || pattern == APPEND)
+		return w->writer ? write(w->fd, w->buf, block)
+				 : read(w->fd, w->buf, block);
+	return w->writer ? pwrite(w->fd, w->buf, block, off)
+			 : pread(w->fd, w->buf, block, off);
+}
+
+static ssize_t do_readv(struct worker *w, off_t off)
+{
+	struct iovec iov[niov];
+	size_t seg = block / niov;
+	int i;
+
+	for (i = 0; i < niov; i++) {
+		iov[i].iov_base = w->buf + i * seg;
+		iov[i].iov_len = i == niov - 1 ? block - i * seg : seg;
+	}
+	if (!seekable || pattern == APPEND)
+		return w->writer ? writev(w->fd, iov, niov)
+				 : readv(w->fd, iov, niov);
+	return w->writer ? pwritev(w->fd, iov, niov, off)
+			 : preadv(w->fd, iov, niov, off);
+}
+
+static ssize_t do_mmap(struct worker *w, off_t off)
+{
+	if (w->writer)
+		memcpy(map + off, w->buf, block);
+	else
+		memcpy(w->buf, map + off, block);
+	return block;
+}
+
+/*
+ * The sync styles: one operation at a time, timed one by one.
+ */
+static void run_sync(struct worker *w)
+{
+	unsigned long long t0;
+	ssize_t ret;
+	off_t off;
+
+	for (w->done = 0; w->done < nops; w->done++) {
+		off = next_offset(w);
+		t0 = now_ns();
+		switch (style) {
+		case READV:
+			ret = do_readv(w, off);
+			break;
+		case MMAP:
+			ret = do_mmap(w, off);
+			break;
+		default:
+			ret = do_rw(w, off);
+		}
+		w->lat[w->done] = now_ns() - t0;
+		if (ret < 0) {
+			w->err = errno;
+			return;
+		}
+		w->bytes += ret;	/* short at quantum boundaries */
+		if (ret == 0)	/* end of data: start over */
+			lseek(w->fd, 0, SEEK_SET);
+	}
+}
+
+/*
+ * Native aio, through the raw system calls to avoid needing libaio.
+ * Up to "depth" requests are kept in flight; the latency of each is
+ * measured from submission to reaping. Regular files only (see above).
+ */
+static void run_aio(struct worker *w)
+{
+	aio_context_t ctx = 0;
+	struct iocb cbs[depth], *cbp;
+	struct io_event ev[depth];
+	unsigned long long start[depth];
+	long submitted = 0;
+	int i, n, slot;
+	int free_slots[depth], nfree = depth;
+
+	if (syscall(SYS_io_setup, depth, &ctx) < 0) {
+		w->err = errno;
+		return;
+	}
+	for (i = 0; i < depth; i++)
+		free_slots[i] = i;
+	w->done = 0;
+	while (w->done < nops) {
+		/* refill the queue */
+		while (nfree && submitted < nops) {
+			slot = free_slots[--nfree];
+			cbp = &cbs[slot];
+			memset(cbp, 0, sizeof(*cbp));
+			cbp->aio_fildes = w->fd;
+			cbp->aio_lio_opcode = w->writer ? IOCB_CMD_PWRITE
+							: IOCB_CMD_PREAD;
+			cbp->aio_buf = (unsigned long)(w->buf + slot * block);
+			cbp->aio_nbytes = block;
+			cbp->aio_offset = next_offset(w);
+			cbp->aio_data = slot;
+			start[slot] = now_ns();
+			if (syscall(SYS_io_submit, ctx, 1, &cbp) != 1) {
+				w->err = errno;
+				goto out;
+			}
+			submitted++;
+		}
+		n = syscall(SYS_io_getevents, ctx, 1, depth, ev, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			w->err = errno;
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			slot = ev[i].data;
+			w->lat[w->done++] = now_ns() - start[slot];
+			free_slots[nfree++] = slot;
+			if ((long long)ev[i].res < 0) {
+				if (!w->err)
+					w->err = -ev[i].res;
+			} else {
+				w->bytes += ev[i].res;
+			}
+		}
+	}
+  out:
+	syscall(SYS_io_destroy, ctx);
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+
+	if (style == AIO)
+		run_aio(w);
+	else
+		run_sync(w);
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int lookup(const char *name, const char **names, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(name, names[i]))
+			return i;
+	fprintf(stderr, "scullbench: unknown mode \"%s\"\n", name);
+	exit(1);
+}
+
+/*
+ * For reads, make sure there is something to read: the device is
+ * written up to the end of the region if it is shorter.
+ */
+static void prefill(int fd)
+{
+	char *buf;
+	off_t size = lseek(fd, 0, SEEK_END);
+
+	if (size >= (off_t)region)
+		return;
+	buf = calloc(1, block);
+	if (!buf)
+		die("calloc");
+	while (size < (off_t)region) {
+		/* scull writes at most up to the end of a quantum */
+		ssize_t ret = pwrite(fd, buf, block, size);
+
+		if (ret <= 0)
+			die("prefill");
+		size += ret;
+	}
+	free(buf);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: scullbench [options] device\n"
+		"  -b bytes    block size (default 4096)\n"
+		"  -t threads  number of threads (default 1)\n"
+		"  -n ops      operations per thread (default 10000)\n"
+		"  -s bytes    region the offsets range over (default 1M)\n"
+		"  -p pattern  seq, random or append (default seq)\n"
+		"  -i style    rw, readv, mmap or aio (default rw);\n"
+		"              aio: regular files only\n"
+		"  -o op       read, write or mixed (default read);\n"
+		"              mixed: even threads write, odd threads read;\n"
+		"              read on scullpipe: someone else must write\n"
+		"  -v segs     readv: segments per block (default 4)\n"
+		"  -q depth    aio: requests in flight per thread (default 8)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned long long t0, elapsed, *all, total = 0;
+	long i, j, nlat = 0;
+	int c, err = 0, flags = O_RDWR;
+	double secs;
+
+	while ((c = getopt(argc, argv, "b:t:n:s:p:i:o:v:q:")) != -1) {
+		switch (c) {
+		case 'b': block = strtoul(optarg, NULL, 0); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'n': nops = atol(optarg); break;
+		case 's': region = strtoul(optarg, NULL, 0); break;
+		case 'p': pattern = lookup(optarg, pattern_names, 3); break;
+		case 'i': style = lookup(optarg, style_names, 4); break;
+		case 'o': op = lookup(optarg, op_names, 3); break;
+		case 'v': niov = atoi(optarg); break;
+		case 'q': depth = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || !block || nthreads < 1 || nops < 1
+	    || niov < 1 || depth < 1 || region < block)
+		usage();
+	device = argv[optind];
+
+	/*
+	 * scull trims the device when opened write-only, so writers ask
+	 * for both directions; append writes go through O_APPEND. Readers
+	 * open read-only, or scullpipe would count them as writers too.
+	 */
+	if (pattern == APPEND)
+		flags |= O_APPEND;
+	seekable = 1;
+	{
+		int fd = open(device, op == READ ? O_RDONLY : flags);
+
+		if (fd < 0)
+			die(device);
+		if (lseek(fd, 0, SEEK_CUR) < 0)
+			seekable = 0;
+		if (seekable && op != WRITE && pattern != APPEND) {
+			int wfd = op == READ ? open(device, O_RDWR) : fd;
+
+			if (wfd < 0)
+				die(device);
+			prefill(wfd);
+			if (wfd != fd)
+				close(wfd);
+		}
+		if (style == MMAP) {
+			if (!seekable || pattern == APPEND) {
+				fprintf(stderr, "scullbench: mmap needs a "
+					"seekable device and no append\n");
+				exit(1);
+			}
+			if (op != READ)
+				prefill(fd);	/* can't grow a mapping */
+			map = mmap(NULL, region, op == READ ? PROT_READ :
+				   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				die("mmap");
+		}
+		/* kept open, so that the mapping lives as long as we do */
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		die("calloc");
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		size_t bufsize = block * (style == AIO ? depth : 1);
+
+		w->id = i;
+		w->writer = op == WRITE || (op == MIXED && !(i & 1));
+		w->seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		w->lat = calloc(nops, sizeof(*w->lat));
+		if (!w->lat || posix_memalign((void **)&w->buf, 4096, bufsize))
+			die("alloc");
+		memset(w->buf, 'a' + i % 26, bufsize);
+		w->fd = open(device, w->writer ? flags : O_RDONLY);
+		if (w->fd < 0)
+			die(device);
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker,
+				   &workers[i]))
+			die("pthread_create");
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - t0;
+
+	for (i = 0; i < nthreads; i++)
+		nlat += workers[i].done;
+	all = malloc((nlat ? nlat : 1) * sizeof(*all));
+	if (!all)
+		die("malloc");
+	for (i = 0, nlat = 0; i < nthreads; i++) {
+		for (j = 0; j < workers[i].done; j++)
+			all[nlat++] = workers[i].lat[j];
+		total += workers[i].bytes;
+		if (workers[i].err && !err)
+			err = workers[i].err;
+		close(workers[i].fd);
+	}
+	qsort(all, nlat, sizeof(*all), cmp_ull);
+	secs = elapsed / 1e9;
+
+	printf("{\"device\": \"%s\", \"op\": \"%s\", \"pattern\": \"%s\", "
+	       "\"style\": \"%s\", \"block\": %zu, \"threads\": %d, "
+	       "\"ops\": %ld, \"bytes\": %llu, \"seconds\": %.6f, "
+	       "\"mb_s\": %.2f, \"iops\": %.0f, \"lat_ns\": {"
+	       "\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+	       device, op_names[op], pattern_names[pattern],
+	       style_names[style], block, nthreads, nlat, total, secs,
+	       total / secs / 1e6, nlat / secs,
+	       nlat ? all[nlat * 50 / 100] : 0,
+	       nlat ? all[nlat * 99 / 100] : 0,
+	       nlat ? all[nlat * 999 / 1000] : 0,
+	       nlat ? all[nlat - 1] : 0);
+	if (err)
+		printf(", \"error\": \"%s\"", strerror(err));
+	printf("}\n");
+	return err ? 1 : 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * cache.c -- a volatile write-back cache in front of the sbull disk
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * With wcache_mb set, writes don't go to the disk pages, but to copies
+ * of them held in the cache, up to that many MiB. Reads find the copy
+ * if there is one. The copies get to the disk ("destaged") when:
+ *
+ *  - a flush comes, for all of them;
+ *  - a FUA write is done, for its own;
+ *  - wcache_destage_ms have passed since the cache got dirty (0 for
+ *    never), or the cache is full: that is the drive doing it on its
+ *    own, in the background.
+ *
+ * Destaging just moves the page over, so it costs nothing: the cost of
+ * a flush is set apart, with flush_ns (see emul.c). When the cache is
+ * full, writes go straight to the disk until it has room again.
+ *
+ * SBULL_IOCCRASH throws the cache away, as a power cut would: whatever
+ * wasn't flushed is lost, and shows up as the old data.
+ *
+ * The cache lock covers making copies, destaging and dropping them;
+ * writes to an existing copy don't take it, any more than writes to
+ * the disk pages do. That is only safe because, with the cache, the
+ * logical block size is a page: a write covers whole pages, so no
+ * copy ever carries part of a page from a write that is still going
+ * on, to be destaged over it. Two writes to one page at once are two
+ * writes to one block, and either may win, as on any disk.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>	/* copy_highpage() */
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+
+#include "sbull.h"
+
+static unsigned long wcache_mb = 0;	/* 0 for no cache */
+module_param(wcache_mb, ulong, 0);
+static unsigned int wcache_destage_ms = 1000;
+module_param(wcache_destage_ms, uint, 0);
+
+struct sbull_cache {
+	spinlock_t lock;
+	struct xarray pages;		/* The dirty copies, by page number */
+	unsigned long nr_dirty;		/* How many */
+	unsigned long max_dirty;
+	unsigned long delay;		/* Before destaging, in jiffies */
+	struct delayed_work destage;
+	struct sbull_dev *dev;
+};
+
+/*
+ * The cached copy of a page, if any; under rcu_read_lock().
+ */
+struct page *sbull_cache_find(struct sbull_dev *dev, pgoff_t index)
+{
+	return dev->cache ? xa_load(&dev->cache->pages, index) : NULL;
+}
+
+/*
+ * Should a write make a copy, rather than go to the disk?
+ */
+bool sbull_cache_room(struct sbull_dev *dev)
+{
+	return dev->cache &&
+		READ_ONCE(dev->cache->nr_dirty) < dev->cache->max_dirty;
+}
+
+/*
+ * Make the cached copy of a page, from what the disk has now; if
+ * someone else just did, that's fine too. Called without the RCU
+ * lock, as it may allocate.
+ */
+int sbull_cache_insert(struct sbull_dev *dev, pgoff_t index, gfp_t gfp)
+{
+	struct sbull_cache *c = dev->cache;
+	struct page *page, *disk;
+	int err = 0;
+
+	page = alloc_page(gfp | __GFP_HIGHMEM);
+	if (!page)
+		return -ENOMEM;
+	spin_lock(&c->lock);
+	if (xa_load(&c->pages, index))
+		goto out_free;
+	if (c->nr_dirty >= c->max_dirty) {
+		err = -ENOSPC;
+		goto out_free;
+	}
+	rcu_read_lock();
+	disk = sbull_disk_page(dev, index);
+	if (disk)
+		copy_highpage(page, disk);
+	else
+		clear_highpage(page);
+	rcu_read_unlock();
+	set_page_private(page, READ_ONCE(dev->generation));
+	err = xa_err(xa_store(&c->pages, index, page, GFP_NOWAIT));
+	if (err)
+		goto out_free;
+	if (++c->nr_dirty == c->max_dirty)
+		mod_delayed_work(system_wq, &c->destage, 0);
+	else if (c->delay)
+		queue_delayed_work(system_wq, &c->destage, c->delay);
+	spin_unlock(&c->lock);
+	return 0;
+
+  out_free:
+	spin_unlock(&c->lock);
+	__free_page(page);
+	return err;
+}
+
+/*
+ * Move the copies of pages "first" to "last" to the disk, where they
+ * replace the old pages. Readers look at the cache first, so they
+ * see the data all along.
+ */
+static int sbull_cache_destage(struct sbull_dev *dev, pgoff_t first,
+		pgoff_t last)
+{
+	struct sbull_cache *c = dev->cache;
+	unsigned long index = first;
+	struct page *page, *old;
+	int err = 0;
+
+	if (!c)
+		return 0;
+	spin_lock(&c->lock);
+	for (page = xa_find(&c->pages, &index, last, XA_PRESENT); page;
+	     page = xa_find_after(&c->pages, &index, last, XA_PRESENT)) {
+		old = xa_store(&dev->pages, index, page, GFP_NOWAIT);
+		if (xa_is_err(old)) {
+			err = -ENOMEM;
+			break;
+		}
+		xa_erase(&c->pages, index);
+		c->nr_dirty--;
+		if (old)
+			call_rcu(&old->rcu_head, sbull_free_page_rcu);
+	}
+	spin_unlock(&c->lock);
+	return err;
+}
+
+int sbull_cache_flush(struct sbull_dev *dev)
+{
+	return sbull_cache_destage(dev, 0, ULONG_MAX);
+}
+
+/*
+ * Destage a range before the disk pages under it change some other way.
+ */
+int sbull_cache_sync(struct sbull_dev *dev, sector_t sector, u64 nbytes)
+{
+	u64 start = (u64)sector*KERNEL_SECTOR_SIZE;
+
+	if (!nbytes)
+		return 0;
+	return sbull_cache_destage(dev, start >> PAGE_SHIFT,
+			(start + nbytes - 1) >> PAGE_SHIFT);
+}
+
+/*
+ * Called once a write is done: a FUA one must be on the disk.
+ */
+int sbull_cache_fua(struct sbull_dev *dev, unsigned int opf, sector_t sector,
+		u64 nbytes)
+{
+	if (!(opf & REQ_FUA) || !op_is_write(opf & REQ_OP_MASK))
+		return 0;
+	return sbull_cache_sync(dev, sector, nbytes);
+}
+
+/*
+ * Lose whatever wasn't flushed.
+ */
+void sbull_cache_crash(struct sbull_dev *dev)
+{
+	struct sbull_cache *c = dev->cache;
+	struct page *page;
+	unsigned long index;
+
+	if (!c)
+		return;
+	spin_lock(&c->lock);
+	xa_for_each(&c->pages, index, page) {
+		xa_erase(&c->pages, index);
+		call_rcu(&page->rcu_head, sbull_free_page_rcu);
+	}
+	c->nr_dirty = 0;
+	spin_unlock(&c->lock);
+}
+
+/*
+ * The background destaging. It can't sleep under the lock, so if the
+ * disk's xarray needs memory it can't get, it tries again a bit later.
+ */
+static void sbull_cache_work(struct work_struct *work)
+{
+	struct sbull_cache *c = container_of(to_delayed_work(work),
+			struct sbull_cache, destage);
+
+	if (sbull_cache_flush(c->dev))
+		queue_delayed_work(system_wq, &c->destage, HZ/10);
+}
+
+int sbull_cache_init(struct sbull_dev *dev)
+{
+	struct sbull_cache *c;
+
+	if (!wcache_mb || dev->file)
+		return 0;
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	spin_lock_init(&c->lock);
+	xa_init(&c->pages);
+	c->max_dirty = max(wcache_mb << (20 - PAGE_SHIFT), 1UL);
+	c->delay = msecs_to_jiffies(wcache_destage_ms);
+	INIT_DELAYED_WORK(&c->destage, sbull_cache_work);
+	c->dev = dev;
+	dev->cache = c;
+	/* see above: no writes to part of a page, nor partial pages */
+	blk_queue_logical_block_size(dev->queue, PAGE_SIZE);
+	dev->size = round_down(dev->size, PAGE_SIZE);
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_write_cache(dev->queue, true, true);
+	return 0;
+}
+
+/*
+ * At unload time, with the queue gone.
+ */
+void sbull_cache_cleanup(struct sbull_dev *dev)
+{
+	struct sbull_cache *c = dev->cache;
+	struct page *page;
+	unsigned long index;
+
+	if (!c)
+		return;
+	cancel_delayed_work_sync(&c->destage);
+	xa_for_each(&c->pages, index, page)
+		__free_page(page);
+	xa_destroy(&c->pages);
+	kfree(c);
+	dev->cache = NULL;
+}
@@ -0,0 +1,221 @@
+/*
+ * emul.c -- make sbull behave like a slower disk
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * The data is still copied in the request function, but the request
+ * is only completed later, from a per-request hrtimer, the way a real
+ * disk would raise its interrupt. Two things decide when:
+ *
+ *  - the caps. Each request keeps the device busy for 1/iops_limit of
+ *    a second, or for its size over bw_limit, whichever is longer.
+ *    Requests take their turn on a single timeline ("busy_until"),
+ *    so the throughput can't go over the caps, whatever the depth.
+ *  - the latency, added once the turn is over: latency_ns, spread
+ *    uniformly by jitter_ns, plus slow_ns for slow_permille requests
+ *    out of a thousand, as the long tail of a flash device. Flushes
+ *    and FUA writes take flush_ns more, for the write cache (cache.c).
+ *
+ * Requests overlap during their latency, so a deep queue gets the
+ * full throughput, and a shallow one is latency bound, as it should.
+ * The hrtimer then goes through blk_mq_complete_request(), so the
+ * completion runs where the block layer wants it (rq_affinity). On
+ * the poll queues there is no timer: the poller finds the request
+ * once its time has come.
+ *
+ * Everything can be changed at run time in /sys/block/sbullX/sbull/.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/device.h>
+#include <linux/genhd.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>	/* prandom_u32() */
+
+#include "sbull.h"
+
+#define SBULL_EMUL_MAX_NS	(3600ULL * NSEC_PER_SEC)	/* an hour */
+
+bool sbull_emul_active(struct sbull_dev *dev)
+{
+	struct sbull_emul *e = &dev->emul;
+
+	return READ_ONCE(e->latency_ns) || READ_ONCE(e->jitter_ns) ||
+		(READ_ONCE(e->slow_ns) && READ_ONCE(e->slow_permille)) ||
+		READ_ONCE(e->iops_limit) || READ_ONCE(e->bw_limit) ||
+		READ_ONCE(e->flush_ns);
+}
+
+/*
+ * How long a request keeps the device busy under the caps.
+ */
+static u64 sbull_emul_service(struct sbull_emul *e, struct request *req)
+{
+	u64 iops = READ_ONCE(e->iops_limit), bw = READ_ONCE(e->bw_limit);
+	u64 t = 0;
+
+	if (iops)
+		t = div64_u64(NSEC_PER_SEC, iops);
+	if (bw && bio_has_data(req->bio))
+		t = max(t, div64_u64((u64)blk_rq_bytes(req) * NSEC_PER_SEC,
+				bw << 20));
+	return t;
+}
+
+/*
+ * Take our turn on the timeline; returns when it ends.
+ */
+static u64 sbull_emul_busy(struct sbull_emul *e, u64 now, u64 service)
+{
+	s64 old, start;
+
+	if (!service)
+		return now;
+	old = atomic64_read(&e->busy_until);
+	do {
+		start = max_t(s64, old, now);
+	} while (!atomic64_try_cmpxchg(&e->busy_until, &old, start + service));
+	return start + service;
+}
+
+static u64 sbull_emul_latency(struct sbull_emul *e, struct request *req)
+{
+	u64 lat = READ_ONCE(e->latency_ns), jitter = READ_ONCE(e->jitter_ns);
+	u64 r;
+
+	if (jitter) {
+		/* uniform over [lat - jitter, lat + jitter], but not below 0 */
+		r = mul_u64_u32_shr(2 * jitter, prandom_u32(), 32);
+		lat = lat + r > jitter ? lat + r - jitter : 0;
+	}
+	if (prandom_u32_max(1000) < READ_ONCE(e->slow_permille))
+		lat += READ_ONCE(e->slow_ns);
+	if (req_op(req) == REQ_OP_FLUSH || (req->cmd_flags & REQ_FUA))
+		lat += READ_ONCE(e->flush_ns);
+	return lat;
+}
+
+static enum hrtimer_restart sbull_emul_timer(struct hrtimer *timer)
+{
+	struct sbull_cmd *cmd = container_of(timer, struct sbull_cmd, timer);
+
+	blk_mq_complete_request(blk_mq_rq_from_pdu(cmd));
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * When a request just copied should complete (ktime_get_ns() time).
+ */
+u64 sbull_emul_deadline(struct sbull_dev *dev, struct request *req)
+{
+	struct sbull_emul *e = &dev->emul;
+	u64 done;
+
+	done = sbull_emul_busy(e, ktime_get_ns(), sbull_emul_service(e, req));
+	return done + sbull_emul_latency(e, req);
+}
+
+/*
+ * Called instead of blk_mq_end_request() once the data is copied.
+ */
+void sbull_emul_end(struct sbull_dev *dev, struct request *req,
+		blk_status_t status)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->status = status;
+	hrtimer_start(&cmd->timer, ns_to_ktime(sbull_emul_deadline(dev, req)),
+			HRTIMER_MODE_ABS);
+}
+
+void sbull_emul_init_cmd(struct sbull_cmd *cmd)
+{
+	hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	cmd->timer.function = sbull_emul_timer;
+}
+
+
+
+/*
+ * The sysfs attributes, one per field.
+ */
+static struct sbull_emul *sbull_emul_of(struct device *d)
+{
+	struct sbull_dev *dev = dev_to_disk(d)->private_data;
+
+	return &dev->emul;
+}
+
+#define SBULL_EMUL_ATTR(name, max)					\
+static ssize_t name##_show(struct device *d,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%llu\n", READ_ONCE(sbull_emul_of(d)->name)); \
+}									\
+static ssize_t name##_store(struct device *d,				\
+		struct device_attribute *attr, const char *buf, size_t count) \
+{									\
+	u64 val;							\
+	int err = kstrtou64(buf, 0, &val);				\
+									\
+	if (err)							\
+		return err;						\
+	if (val > (max))						\
+		return -EINVAL;						\
+	WRITE_ONCE(sbull_emul_of(d)->name, val);			\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(name)
+
+SBULL_EMUL_ATTR(latency_ns, SBULL_EMUL_MAX_NS);
+SBULL_EMUL_ATTR(jitter_ns, SBULL_EMUL_MAX_NS);
+SBULL_EMUL_ATTR(slow_ns, SBULL_EMUL_MAX_NS);
+SBULL_EMUL_ATTR(slow_permille, 1000);
+SBULL_EMUL_ATTR(iops_limit, U64_MAX);
+SBULL_EMUL_ATTR(bw_limit, U64_MAX >> 20);
+SBULL_EMUL_ATTR(flush_ns, SBULL_EMUL_MAX_NS);
+
+static struct attribute *sbull_emul_attrs[] = {
+	&dev_attr_latency_ns.attr,
+	&dev_attr_jitter_ns.attr,
+	&dev_attr_slow_ns.attr,
+	&dev_attr_slow_permille.attr,
+	&dev_attr_iops_limit.attr,
+	&dev_attr_bw_limit.attr,
+	&dev_attr_flush_ns.attr,
+	NULL
+};
+
+/*
+ * Only blk-mq requests have a timer to complete them (polled ones are
+ * reaped when due, see sbull_poll).
+ */
+static umode_t sbull_emul_visible(struct kobject *kobj, struct attribute *attr,
+		int n)
+{
+	struct sbull_dev *dev = dev_to_disk(kobj_to_dev(kobj))->private_data;
+
+	return queue_is_mq(dev->queue) ? attr->mode : 0;
+}
+
+const struct attribute_group sbull_emul_attr_group = {
+	.name		= "sbull",
+	.attrs		= sbull_emul_attrs,
+	.is_visible	= sbull_emul_visible,
+};
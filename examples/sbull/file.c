@@ -0,0 +1,292 @@
+/*
+ * file.c -- sbull disks kept in a file
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * backing=<file>[,<file>...] keeps sbulla, sbullb... in those files
+ * rather than in memory, so the data survives reloads and media
+ * changes. A file shorter than the disk is extended; an empty name
+ * leaves that disk in memory. A memfd can be given as /proc/<pid>/fd/<n>.
+ *
+ * Reads and writes become asynchronous direct I/O on the file, as with
+ * the loop driver: the request's pages go to the file system as they
+ * are, and the request completes from ki_complete. Up to queue_depth
+ * of them are in flight on each hardware queue. Where the file system
+ * can't do direct I/O (tmpfs, so memfds), the file is opened without
+ * O_DIRECT, and the same calls go through the page cache, synchronously.
+ *
+ * Flushes become fsync, discards and write zeroes fallocate. All this
+ * may sleep, so these queues are BLK_MQ_F_BLOCKING; and as it takes a
+ * request queue, RM_NOQUEUE disks stay in memory. It may allocate too,
+ * which must not recurse into I/O: reclaim could come back to this
+ * very disk, and wait for it. The file system is called in a
+ * memalloc_noio scope.
+ *
+ * The write cache, zones and the page store are for memory disks
+ * only: a file-backed disk is a plain, persistent disk.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/sched/mm.h>	/* memalloc_noio_save() */
+#include <linux/falloc.h>
+#include <linux/uio.h>
+#include <linux/ioprio.h>
+#include <linux/err.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+
+#include "sbull.h"
+
+#define SBULL_MAX_BACKING	26	/* sbulla to sbullz */
+
+static char *backing[SBULL_MAX_BACKING];
+static int nbacking;
+module_param_array(backing, charp, &nbacking, 0);
+
+/*
+ * Open the backing file of disk "which", if it has one.
+ */
+int sbull_file_open(struct sbull_dev *dev, int which)
+{
+	const char *path;
+	struct file *file;
+	int err;
+
+	if (which >= nbacking || !backing[which] || !*backing[which])
+		return 0;
+	path = backing[which];
+	file = filp_open(path, O_RDWR | O_LARGEFILE | O_DIRECT, 0);
+	if (file == ERR_PTR(-EINVAL))
+		file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_err;
+	}
+	err = -EINVAL;
+	if (!S_ISREG(file_inode(file)->i_mode))
+		goto out_close;
+	if (i_size_read(file_inode(file)) < dev->size) {
+		err = vfs_truncate(&file->f_path, dev->size);
+		if (err)
+			goto out_close;
+	}
+	dev->file = file;
+	return 0;
+
+  out_close:
+	filp_close(file, NULL);
+  out_err:
+	printk(KERN_WARNING "sbull: can't use %s, error %i\n", path, err);
+	return err;
+}
+
+void sbull_file_close(struct sbull_dev *dev)
+{
+	if (!dev->file)
+		return;
+	filp_close(dev->file, NULL);
+	dev->file = NULL;
+}
+
+/*
+ * The limits the file adds to those of setup_device().
+ */
+void sbull_file_setup_queue(struct sbull_dev *dev)
+{
+	struct request_queue *q = dev->queue;
+	struct super_block *sb = file_inode(dev->file)->i_sb;
+
+	/* Direct I/O must be aligned for the disk under the file */
+	if ((dev->file->f_flags & O_DIRECT) && sb->s_bdev)
+		blk_queue_logical_block_size(q, max_t(unsigned int,
+				queue_logical_block_size(q),
+				bdev_logical_block_size(sb->s_bdev)));
+	/* What we write is in the page cache, or the disk's, until fsync */
+	blk_queue_write_cache(q, true, false);
+	blk_queue_flag_clear(QUEUE_FLAG_SECERASE, q);
+	if (!dev->file->f_op->fallocate) {
+		blk_queue_flag_clear(QUEUE_FLAG_DISCARD, q);
+		blk_queue_max_write_zeroes_sectors(q, 0);
+	}
+}
+
+/*
+ * End a request, at once or when the emulated disk would.
+ */
+static void sbull_file_end(struct sbull_dev *dev, struct request *req,
+		blk_status_t status)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	if (sbull_emul_active(dev)) {
+		sbull_emul_end(dev, req, status);
+		return;
+	}
+	cmd->status = status;
+	blk_mq_complete_request(req);
+}
+
+/*
+ * The submitter and ki_complete each hold a reference, so the bvec
+ * array stays until both are done with it.
+ */
+static void sbull_file_put(struct sbull_cmd *cmd)
+{
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+
+	if (!atomic_dec_and_test(&cmd->ref))
+		return;
+	kfree(cmd->bvec);
+	cmd->bvec = NULL;
+	if (cmd->ret == blk_rq_bytes(req))
+		sbull_file_end(req->q->queuedata, req, BLK_STS_OK);
+	else
+		sbull_file_end(req->q->queuedata, req,
+				errno_to_blk_status(cmd->ret < 0 ? cmd->ret : -EIO));
+}
+
+static void sbull_file_complete(struct kiocb *iocb, long ret, long ret2)
+{
+	struct sbull_cmd *cmd = container_of(iocb, struct sbull_cmd, iocb);
+
+	cmd->ret = ret;
+	sbull_file_put(cmd);
+}
+
+/*
+ * Start a read or a write on the file; it completes by itself. A
+ * request of one bio uses its bvec array in place, others need one
+ * of their own.
+ */
+static int sbull_file_rw(struct sbull_dev *dev, struct request *req)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+	struct bio *bio = req->bio;
+	struct req_iterator rq_iter;
+	struct bio_vec tmp, *bvec;
+	struct iov_iter iter;
+	unsigned int nr_bvec = 0, offset = 0;
+	int write = op_is_write(req_op(req));
+	unsigned int noio_flag;
+	ssize_t ret;
+
+	rq_for_each_bvec(tmp, req, rq_iter)
+		nr_bvec++;
+	if (req->bio != req->biotail) {
+		bvec = kmalloc_array(nr_bvec, sizeof(*bvec), GFP_NOIO);
+		if (!bvec)
+			return -ENOMEM;
+		cmd->bvec = bvec;
+		rq_for_each_bvec(tmp, req, rq_iter)
+			*bvec++ = tmp;
+		bvec = cmd->bvec;
+	} else {
+		offset = bio->bi_iter.bi_bvec_done;
+		bvec = __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter);
+	}
+	iov_iter_bvec(&iter, write ? WRITE : READ, bvec, nr_bvec,
+			blk_rq_bytes(req));
+	iter.iov_offset = offset;
+
+	cmd->iocb.ki_pos = (loff_t)blk_rq_pos(req) << SECTOR_SHIFT;
+	cmd->iocb.ki_filp = dev->file;
+	cmd->iocb.ki_complete = sbull_file_complete;
+	cmd->iocb.ki_flags = dev->file->f_flags & O_DIRECT ? IOCB_DIRECT : 0;
+	cmd->iocb.ki_ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+	atomic_set(&cmd->ref, 2);
+
+	noio_flag = memalloc_noio_save();
+	if (write)
+		ret = call_write_iter(dev->file, &cmd->iocb, &iter);
+	else
+		ret = call_read_iter(dev->file, &cmd->iocb, &iter);
+	memalloc_noio_restore(noio_flag);
+	sbull_file_put(cmd);
+	if (ret != -EIOCBQUEUED)
+		sbull_file_complete(&cmd->iocb, ret, 0);
+	return 0;
+}
+
+static int sbull_file_fallocate(struct sbull_dev *dev, int mode,
+		struct request *req)
+{
+	unsigned int noio_flag = memalloc_noio_save();
+	int err;
+
+	err = vfs_fallocate(dev->file, mode | FALLOC_FL_KEEP_SIZE,
+			(loff_t)blk_rq_pos(req) << SECTOR_SHIFT, blk_rq_bytes(req));
+	memalloc_noio_restore(noio_flag);
+	return err;
+}
+
+static int sbull_file_fsync(struct sbull_dev *dev)
+{
+	unsigned int noio_flag = memalloc_noio_save();
+	int err;
+
+	err = vfs_fsync(dev->file, 0);
+	memalloc_noio_restore(noio_flag);
+	return err;
+}
+
+/*
+ * The request function of file-backed disks, whatever the request
+ * mode. It may sleep.
+ */
+blk_status_t sbull_file_request(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct sbull_dev *dev = hctx->queue->queuedata;
+	int err;
+
+	blk_mq_start_request(req);
+	if (blk_rq_is_passthrough(req)) {
+		printk (KERN_NOTICE "Skip non-fs request\n");
+		blk_mq_end_request(req, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+	err = sbull_check_range(dev, blk_rq_pos(req), blk_rq_bytes(req));
+	if (err)
+		goto out;
+	switch (req_op(req)) {
+	    case REQ_OP_READ:
+	    case REQ_OP_WRITE:
+		err = sbull_file_rw(dev, req);
+		if (err == -ENOMEM)
+			return BLK_STS_RESOURCE;
+		if (!err)
+			return BLK_STS_OK;	/* it completes by itself */
+		break;
+	    case REQ_OP_FLUSH:
+		err = sbull_file_fsync(dev);
+		break;
+	    case REQ_OP_DISCARD:
+		err = sbull_file_fallocate(dev, FALLOC_FL_PUNCH_HOLE, req);
+		break;
+	    case REQ_OP_WRITE_ZEROES:
+		err = sbull_file_fallocate(dev, req->cmd_flags & REQ_NOUNMAP ?
+				FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE, req);
+		break;
+	    default:
+		err = -EOPNOTSUPP;
+	}
+  out:
+	sbull_file_end(dev, req, errno_to_blk_status(err));
+	return BLK_STS_OK;
+}
@@ -0,0 +1,1168 @@
+/*
+ * Sample disk driver, from the beginning.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+
+#include <linux/sched.h>
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/capability.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/types.h>	/* size_t */
+#include <linux/hdreg.h>	/* HDIO_GETGEO */
+#include <linux/highmem.h>	/* kmap_atomic() */
+#include <linux/xarray.h>
+#include <linux/nodemask.h>
+#include <linux/log2.h>		/* is_power_of_2() */
+#include <linux/genhd.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/bio.h>
+
+#include "sbull.h"
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+static int sbull_major = 0;
+module_param(sbull_major, int, 0);
+static int hardsect_size = 512;
+module_param(hardsect_size, int, 0);
+static unsigned long nsectors = 1024;	/* How big the drive is */
+module_param(nsectors, ulong, 0);
+static int ndevices = 4;
+module_param(ndevices, int, 0);
+
+/*
+ * The different "request modes" we can use.
+ */
+enum {
+	RM_SIMPLE  = 0,	/* The extra-simple request function */
+	RM_FULL    = 1,	/* The full-blown version */
+	RM_NOQUEUE = 2,	/* Use make_request */
+	RM_MQ      = 3,	/* Many hardware queues, no lock */
+};
+static int request_mode = RM_SIMPLE;
+module_param(request_mode, int, 0);
+
+/*
+ * The hardware queues of RM_MQ: how many, how deep, and which CPUs
+ * feed each of them. With hw_queues = 0 there is one per CPU, or one
+ * per node.
+ */
+enum {
+	QM_CPU  = 0,	/* Queues are spread over the CPUs */
+	QM_NODE = 1,	/* All the CPUs of a node share a queue */
+};
+static int hw_queues = 0;
+module_param(hw_queues, int, 0);
+static int queue_depth = 64;
+module_param(queue_depth, int, 0);
+static int queue_map = QM_CPU;
+module_param(queue_map, int, 0);
+
+/*
+ * RM_MQ can also have poll queues, on top of the others: requests with
+ * REQ_HIPRI (io_uring IOPOLL, preadv2 RWF_HIPRI) go there, and are
+ * completed when the submitter polls for them, with no interrupt-like
+ * completion at all.
+ */
+static int poll_queues = 0;
+module_param(poll_queues, int, 0);
+
+/*
+ * The timing of a slower disk, for the blk-mq modes; see emul.c. They
+ * are the defaults of every device, and can be changed later in sysfs.
+ */
+static unsigned long latency_ns = 0;
+module_param(latency_ns, ulong, 0);
+static unsigned long jitter_ns = 0;
+module_param(jitter_ns, ulong, 0);
+static unsigned long slow_ns = 0;
+module_param(slow_ns, ulong, 0);
+static int slow_permille = 0;
+module_param(slow_permille, int, 0);
+static unsigned long iops_limit = 0;
+module_param(iops_limit, ulong, 0);
+static unsigned long bw_limit = 0;	/* MiB/s */
+module_param(bw_limit, ulong, 0);
+static unsigned long flush_ns = 0;	/* For flushes and FUA writes */
+module_param(flush_ns, ulong, 0);
+
+/*
+ * Minor number and partition management.
+ */
+#define SBULL_MINORS	16
+#define MINOR_SHIFT	4
+#define DEVNUM(kdevnum)	(MINOR(kdev_t_to_nr(kdevnum)) >> MINOR_SHIFT
+
+/*
+ * After this much idle time, the driver will simulate a media change.
+ */
+#define INVALIDATE_DELAY	30*HZ
+
+/*
+ * Discards and write zeroes run in the request function, and can't
+ * reschedule; this bounds the pages one of them can visit.
+ */
+#define SBULL_MAX_DISCARD	((1 << 30) / KERNEL_SECTOR_SIZE)	/* 1GB */
+
+/*
+ * The largest read or write we take; the block layer still defaults
+ * to BLK_DEF_MAX_SECTORS, but max_sectors_kb can go up to this.
+ */
+#define SBULL_MAX_SECTORS	((4 << 20) / KERNEL_SECTOR_SIZE)	/* 4MB */
+
+static struct sbull_dev *Devices = NULL;
+
+/*
+ * The data lives in pages that are only allocated when first written;
+ * a page that isn't there reads as zeros. So an empty disk costs
+ * nothing but the xarray, whatever its size.
+ *
+ * Discards remove pages while other requests may be looking at them,
+ * so pages are only used under rcu_read_lock, and freed after a grace
+ * period.
+ *
+ * A media change doesn't touch the pages: it only moves to the next
+ * generation, and the pages of older ones (in page_private) are as
+ * good as gone. They read as zeros, the first write replaces them,
+ * and sbull_reclaim() frees the rest in the background. So the new
+ * media is blank at once, whatever the size of the disk.
+ */
+static inline bool sbull_page_live(struct sbull_dev *dev, struct page *page)
+{
+	return page_private(page) == READ_ONCE(dev->generation);
+}
+
+/*
+ * The disk's page for "index", if it has data of this media.
+ */
+struct page *sbull_disk_page(struct sbull_dev *dev, pgoff_t index)
+{
+	struct page *page = xa_load(&dev->pages, index);
+
+	return page && sbull_page_live(dev, page) ? page : NULL;
+}
+
+void sbull_free_page_rcu(struct rcu_head *head)
+{
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+/*
+ * Add a blank page for a write; the caller looks it up again.
+ */
+static int sbull_insert_page(struct sbull_dev *dev, pgoff_t index, gfp_t gfp)
+{
+	struct page *page, *cur;
+	bool done = false;
+
+	page = alloc_page(gfp | __GFP_ZERO | __GFP_HIGHMEM);
+	if (!page)
+		return -ENOMEM;
+	set_page_private(page, READ_ONCE(dev->generation));
+	while (!done) {
+		cur = xa_cmpxchg(&dev->pages, index, NULL, page, gfp);
+		if (!cur)
+			return 0;
+		if (xa_is_err(cur)) {
+			__free_page(page);
+			return -ENOMEM;
+		}
+		/*
+		 * Someone else got there first, or a stale page is in
+		 * the way: replace it (that takes no memory).
+		 */
+		rcu_read_lock();
+		cur = xa_load(&dev->pages, index);
+		if (cur && sbull_page_live(dev, cur)) {
+			done = true;
+		} else if (cur && xa_cmpxchg(&dev->pages, index, cur, page,
+					GFP_NOWAIT) == cur) {
+			call_rcu(&cur->rcu_head, sbull_free_page_rcu);
+			page = NULL;
+			done = true;
+		}
+		rcu_read_unlock();
+	}
+	if (page)
+		__free_page(page);
+	return 0;
+}
+
+/*
+ * Free the pages of older generations, in the background.
+ */
+static void sbull_reclaim(struct work_struct *work)
+{
+	struct sbull_dev *dev = container_of(work, struct sbull_dev, reclaim);
+	unsigned long index = 0;
+	struct page *page;
+
+	rcu_read_lock();
+	for (page = xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT); page;
+	     page = xa_find_after(&dev->pages, &index, ULONG_MAX, XA_PRESENT)) {
+		if (!sbull_page_live(dev, page) &&
+		    xa_cmpxchg(&dev->pages, index, page, NULL, 0) == page)
+			call_rcu(&page->rcu_head, sbull_free_page_rcu);
+		if (need_resched()) {
+			rcu_read_unlock();
+			cond_resched();
+			rcu_read_lock();
+		}
+	}
+	rcu_read_unlock();
+}
+
+static void sbull_free_pages(struct sbull_dev *dev)
+{
+	struct page *page;
+	unsigned long index;
+
+	xa_for_each(&dev->pages, index, page)
+		__free_page(page);
+	xa_destroy(&dev->pages);
+}
+
+/*
+ * Check a request against the end of the disk, once for all its pieces.
+ */
+int sbull_check_range(struct sbull_dev *dev, sector_t sector, u64 nbytes)
+{
+	u64 offset = (u64)sector*KERNEL_SECTOR_SIZE;
+
+	if (offset + nbytes > dev->size) {
+		printk (KERN_NOTICE "Beyond-end access (%llu %llu)\n", offset, nbytes);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Where the data of page "index" is now: in the write cache if it has
+ * a copy, on the disk otherwise. While the cache has room, writes that
+ * find no copy get nothing, and make one.
+ */
+static struct page *sbull_find_page(struct sbull_dev *dev, pgoff_t index,
+		int write)
+{
+	struct page *page = sbull_cache_find(dev, index);
+
+	if (page || (write && sbull_cache_room(dev)))
+		return page;
+	return sbull_disk_page(dev, index);
+}
+
+static int sbull_add_page(struct sbull_dev *dev, pgoff_t index, gfp_t gfp)
+{
+	int err = -ENOSPC;
+
+	if (sbull_cache_room(dev))
+		err = sbull_cache_insert(dev, index, gfp);
+	if (err == -ENOSPC)
+		err = sbull_insert_page(dev, index, gfp);
+	return err;
+}
+
+/*
+ * Copy a bvec to or from the disk, starting at byte "pos". A bvec may
+ * cover many pages (a large folio, or pages that blk-mq merged): they
+ * are contiguous, so without highmem they are mapped contiguously too,
+ * and each memcpy goes as far as the end of one of our pages. With
+ * highmem, each page of the bvec is mapped on its own.
+ *
+ * Writes allocate their pages with "gfp", and return -ENOMEM if they
+ * can't.
+ */
+static int sbull_transfer(struct sbull_dev *dev, u64 pos,
+		const struct bio_vec *bvec, int write, gfp_t gfp)
+{
+	unsigned int off = bvec->bv_offset, len = bvec->bv_len;
+	unsigned int poff, chunk;
+	struct page *page;
+	char *buffer, *mem;
+
+	rcu_read_lock();
+	while (len) {
+		poff = pos & ~PAGE_MASK;
+		chunk = min_t(unsigned int, len, PAGE_SIZE - poff);
+		if (IS_ENABLED(CONFIG_HIGHMEM))
+			chunk = min_t(unsigned int, chunk,
+					PAGE_SIZE - offset_in_page(off));
+		page = sbull_find_page(dev, pos >> PAGE_SHIFT, write);
+		if (write && !page) {
+			rcu_read_unlock();
+			if (sbull_add_page(dev, pos >> PAGE_SHIFT, gfp))
+				return -ENOMEM;
+			rcu_read_lock();
+			continue;
+		}
+		buffer = kmap_atomic(nth_page(bvec->bv_page, off >> PAGE_SHIFT));
+		buffer += offset_in_page(off);
+		if (page) {
+			mem = kmap_atomic(page);
+			if (write)
+				memcpy(mem + poff, buffer, chunk);
+			else
+				memcpy(buffer, mem + poff, chunk);
+			kunmap_atomic(mem);
+		} else {
+			memset(buffer, 0, chunk);
+		}
+		kunmap_atomic(buffer);
+		pos += chunk;
+		off += chunk;
+		len -= chunk;
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/*
+ * Discard, secure erase and write zeroes. Pages wholly inside the range
+ * are dropped, unless SBULL_KEEP asks to keep them allocated; the rest
+ * is cleared in place. Only the pages that exist are visited, so even
+ * a huge range on a thin disk is quick.
+ */
+#define SBULL_SECURE	1	/* Clear pages before freeing them */
+#define SBULL_KEEP	2	/* Zero, but don't free */
+
+int sbull_discard(struct sbull_dev *dev, sector_t sector, u64 nbytes,
+		int flags)
+{
+	u64 start = (u64)sector*KERNEL_SECTOR_SIZE, end = start + nbytes;
+	unsigned long index = start >> PAGE_SHIFT;
+	unsigned long last = (end - 1) >> PAGE_SHIFT;
+	unsigned int poff, len;
+	struct page *page;
+	u64 pstart;
+	int err;
+
+	if (!nbytes)
+		return 0;
+	err = sbull_cache_sync(dev, sector, nbytes);
+	if (err)
+		return err;
+	rcu_read_lock();
+	for (page = xa_find(&dev->pages, &index, last, XA_PRESENT); page;
+	     page = xa_find_after(&dev->pages, &index, last, XA_PRESENT)) {
+		pstart = (u64)index << PAGE_SHIFT;
+		poff = max(start, pstart) - pstart;
+		len = min(end, pstart + PAGE_SIZE) - pstart - poff;
+		if (len < PAGE_SIZE || (flags & SBULL_KEEP)) {
+			zero_user(page, poff, len);
+			continue;
+		}
+		page = xa_erase(&dev->pages, index);
+		if (!page)
+			continue;	/* a concurrent discard took it */
+		if (flags & SBULL_SECURE)
+			clear_highpage(page);
+		call_rcu(&page->rcu_head, sbull_free_page_rcu);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/*
+ * The operations without data. Anything else we don't know about.
+ */
+static int sbull_nodata(struct sbull_dev *dev, unsigned int op, bool unmap,
+		sector_t sector, u64 nbytes)
+{
+	switch (op) {
+	    case REQ_OP_FLUSH:
+		return sbull_cache_flush(dev);
+	    case REQ_OP_DISCARD:
+		return sbull_discard(dev, sector, nbytes, 0);
+	    case REQ_OP_SECURE_ERASE:
+		return sbull_discard(dev, sector, nbytes, SBULL_SECURE);
+	    case REQ_OP_WRITE_ZEROES:
+		return sbull_discard(dev, sector, nbytes, unmap ? 0 : SBULL_KEEP);
+	}
+	return -EOPNOTSUPP;
+}
+
+static inline bool sbull_has_data(unsigned int op)
+{
+	return op == REQ_OP_READ || op == REQ_OP_WRITE;
+}
+
+/*
+ * What we keep with every hardware queue.
+ */
+struct sbull_queue {
+	spinlock_t lock;		/* Protects poll_list */
+	struct list_head poll_list;	/* Requests done, but not reaped */
+};
+
+/*
+ * A request on a poll queue waits there for sbull_poll.
+ */
+static void sbull_poll_add(struct sbull_dev *dev, struct request *req,
+		blk_status_t status)
+{
+	struct sbull_queue *sq = req->mq_hctx->driver_data;
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	cmd->status = status;
+	cmd->deadline = sbull_emul_active(dev) ? sbull_emul_deadline(dev, req) : 0;
+	spin_lock(&sq->lock);
+	list_add_tail(&cmd->list, &sq->poll_list);
+	spin_unlock(&sq->lock);
+}
+
+/*
+ * Complete a request with the result of its transfer, now or when the
+ * emulated disk would. A request that ran out of memory goes back to
+ * blk-mq instead, which retries it a little later; writing again the
+ * pages it did get is harmless. A zone reset (-EINPROGRESS) completes
+ * by itself.
+ */
+static blk_status_t sbull_end_request(struct request *req, int err)
+{
+	struct sbull_dev *dev = req->q->queuedata;
+
+	if (err == -ENOMEM)
+		return BLK_STS_RESOURCE;
+	if (err == -EINPROGRESS)
+		return BLK_STS_OK;
+	if (req->mq_hctx->type == HCTX_TYPE_POLL)
+		sbull_poll_add(dev, req, errno_to_blk_status(err));
+	else if (sbull_emul_active(dev))
+		sbull_emul_end(dev, req, errno_to_blk_status(err));
+	else
+		blk_mq_end_request(req, errno_to_blk_status(err));
+	return BLK_STS_OK;
+}
+
+/*
+ * The deferred completions end here.
+ */
+static void sbull_complete(struct request *req)
+{
+	struct sbull_cmd *cmd = blk_mq_rq_to_pdu(req);
+
+	blk_mq_end_request(req, cmd->status);
+}
+
+static int sbull_init_request(struct blk_mq_tag_set *set, struct request *req,
+		unsigned int hctx_idx, unsigned int numa_node)
+{
+	sbull_emul_init_cmd(blk_mq_rq_to_pdu(req));
+	return 0;
+}
+
+/*
+ * The request functions can't sleep, so they allocate with GFP_NOWAIT.
+ *
+ * The simple form of the request function. There is a single hardware
+ * queue, and the whole transfer happens under the device lock.
+ */
+static blk_status_t sbull_request(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct sbull_dev *dev = hctx->queue->queuedata;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	u64 pos = (u64)blk_rq_pos(req)*KERNEL_SECTOR_SIZE;
+	int err;
+
+	blk_mq_start_request(req);
+	if (blk_rq_is_passthrough(req)) {
+		printk (KERN_NOTICE "Skip non-fs request\n");
+		blk_mq_end_request(req, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+//	printk (KERN_NOTICE "Req dev %d dir %d sec %lld, nr %d\n",
+//			(int)(dev - Devices), rq_data_dir(req),
+//			(long long)blk_rq_pos(req), blk_rq_sectors(req));
+	spin_lock_bh(&dev->lock);
+	err = sbull_check_range(dev, blk_rq_pos(req), blk_rq_bytes(req));
+	if (err)
+		goto out;
+	if (dev->zoned) {
+		err = sbull_zoned_rq(dev, req, GFP_NOWAIT);
+		goto out;
+	}
+	if (!sbull_has_data(req_op(req))) {
+		err = sbull_nodata(dev, req_op(req),
+				!(req->cmd_flags & REQ_NOUNMAP),
+				blk_rq_pos(req), blk_rq_bytes(req));
+		goto out;
+	}
+	/* One page at a time */
+	rq_for_each_segment(bvec, req, iter) {
+		err = sbull_transfer(dev, pos, &bvec, rq_data_dir(req),
+				GFP_NOWAIT);
+		if (err)
+			break;
+		pos += bvec.bv_len;
+	}
+	if (!err)
+		err = sbull_cache_fua(dev, req->cmd_flags, blk_rq_pos(req),
+				blk_rq_bytes(req));
+  out:
+	spin_unlock_bh(&dev->lock);
+	return sbull_end_request(req, err);
+}
+
+
+/*
+ * Transfer a single BIO.
+ */
+static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio, gfp_t gfp)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	u64 pos = (u64)bio->bi_iter.bi_sector*KERNEL_SECTOR_SIZE;
+	int err;
+
+	err = sbull_check_range(dev, bio->bi_iter.bi_sector,
+			bio->bi_iter.bi_size);
+	if (!err && (bio->bi_opf & REQ_PREFLUSH))
+		err = sbull_cache_flush(dev);	/* only without blk-mq */
+	if (err)
+		return err;
+	if (!sbull_has_data(bio_op(bio)))
+		return sbull_nodata(dev, bio_op(bio),
+				!(bio->bi_opf & REQ_NOUNMAP),
+				bio->bi_iter.bi_sector, bio->bi_iter.bi_size);
+	/* Whole multi-page segments at a time */
+	bio_for_each_bvec(bvec, bio, iter) {
+		err = sbull_transfer(dev, pos, &bvec, bio_data_dir(bio) == WRITE,
+				gfp);
+		if (err)
+			return err;
+		pos += bvec.bv_len;
+	}
+	return sbull_cache_fua(dev, bio->bi_opf, bio->bi_iter.bi_sector,
+			bio->bi_iter.bi_size);
+}
+
+/*
+ * Transfer a full request.
+ */
+static int sbull_xfer_request(struct sbull_dev *dev, struct request *req,
+		gfp_t gfp)
+{
+	struct bio *bio;
+	int err;
+
+	if (dev->zoned)
+		return sbull_zoned_rq(dev, req, gfp);
+	__rq_for_each_bio(bio, req) {
+		err = sbull_xfer_bio(dev, bio, gfp);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Transfer the data of a request from "sector" on, wherever the request
+ * says it goes; zone appends are written at the write pointer.
+ */
+int sbull_xfer_rq_at(struct sbull_dev *dev, struct request *req,
+		sector_t sector, gfp_t gfp)
+{
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	u64 pos = (u64)sector*KERNEL_SECTOR_SIZE;
+	int err;
+
+	rq_for_each_bvec(bvec, req, iter) {
+		err = sbull_transfer(dev, pos, &bvec, op_is_write(req_op(req)),
+				gfp);
+		if (err)
+			return err;
+		pos += bvec.bv_len;
+	}
+	return sbull_cache_fua(dev, req->cmd_flags, sector, blk_rq_bytes(req));
+}
+
+
+
+/*
+ * Smarter request function that "handles clustering".
+ */
+static blk_status_t sbull_full_request(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct sbull_dev *dev = hctx->queue->queuedata;
+	int err;
+
+	blk_mq_start_request(req);
+	if (blk_rq_is_passthrough(req)) {
+		printk (KERN_NOTICE "Skip non-fs request\n");
+		blk_mq_end_request(req, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+	spin_lock_bh(&dev->lock);
+	err = sbull_xfer_request(dev, req, GFP_NOWAIT);
+	spin_unlock_bh(&dev->lock);
+	return sbull_end_request(req, err);
+}
+
+
+
+/*
+ * The multiqueue version. Each hardware queue is fed by its own CPUs,
+ * and requests to different sectors have nothing in common, so they
+ * are transferred without any lock; as with a real disk, it's up to
+ * the upper layers not to have overlapping requests in flight.
+ */
+static blk_status_t sbull_mq_request(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct sbull_dev *dev = hctx->queue->queuedata;
+	int err;
+
+	blk_mq_start_request(req);
+	if (blk_rq_is_passthrough(req)) {
+		printk (KERN_NOTICE "Skip non-fs request\n");
+		blk_mq_end_request(req, BLK_STS_IOERR);
+		return BLK_STS_OK;
+	}
+	err = sbull_xfer_request(dev, req, GFP_NOWAIT);
+	return sbull_end_request(req, err);
+}
+
+/*
+ * The position of a node among the online ones, as node numbers
+ * may have holes.
+ */
+static int sbull_node_index(int node)
+{
+	int n, index = 0;
+
+	for_each_online_node(n) {
+		if (n == node)
+			return index;
+		index++;
+	}
+	return 0;
+}
+
+/*
+ * Tell blk-mq which hardware queue each CPU submits to. With poll
+ * queues, they come after the default ones, and are spread over the
+ * CPUs on their own; there are no separate read queues.
+ */
+static int sbull_map_queues(struct blk_mq_tag_set *set)
+{
+	struct blk_mq_queue_map *qmap = &set->map[HCTX_TYPE_DEFAULT];
+	unsigned int cpu;
+	int polled = set->nr_maps > HCTX_TYPE_POLL ? poll_queues : 0;
+
+	qmap->nr_queues = set->nr_hw_queues - polled;
+	qmap->queue_offset = 0;
+	if (queue_map == QM_NODE) {
+		for_each_possible_cpu(cpu)
+			qmap->mq_map[cpu] = qmap->queue_offset +
+				sbull_node_index(cpu_to_node(cpu)) % qmap->nr_queues;
+	} else {
+		blk_mq_map_queues(qmap);
+	}
+	if (!polled)
+		return 0;
+
+	set->map[HCTX_TYPE_READ].nr_queues = 0;
+	qmap = &set->map[HCTX_TYPE_POLL];
+	qmap->nr_queues = polled;
+	qmap->queue_offset = set->nr_hw_queues - polled;
+	return blk_mq_map_queues(qmap);
+}
+
+/*
+ * Reap the requests of a poll queue whose time has come (all of them,
+ * unless emulating a slower disk); returns how many.
+ */
+static int sbull_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct sbull_queue *sq = hctx->driver_data;
+	struct sbull_cmd *cmd, *next;
+	u64 now = ktime_get_ns();
+	LIST_HEAD(done);
+	int found = 0;
+
+	spin_lock(&sq->lock);
+	list_for_each_entry_safe(cmd, next, &sq->poll_list, list)
+		if (cmd->deadline <= now)
+			list_move_tail(&cmd->list, &done);
+	spin_unlock(&sq->lock);
+
+	list_for_each_entry_safe(cmd, next, &done, list) {
+		list_del(&cmd->list);
+		blk_mq_end_request(blk_mq_rq_from_pdu(cmd), cmd->status);
+		found++;
+	}
+	return found;
+}
+
+static int sbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+		unsigned int index)
+{
+	struct sbull_queue *sq;
+
+	sq = kzalloc_node(sizeof(*sq), GFP_KERNEL, hctx->numa_node);
+	if (!sq)
+		return -ENOMEM;
+	spin_lock_init(&sq->lock);
+	INIT_LIST_HEAD(&sq->poll_list);
+	hctx->driver_data = sq;
+	return 0;
+}
+
+static void sbull_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int index)
+{
+	kfree(hctx->driver_data);
+}
+
+static const struct blk_mq_ops sbull_simple_ops = {
+	.queue_rq	= sbull_request,
+	.complete	= sbull_complete,
+	.init_request	= sbull_init_request,
+	.init_hctx	= sbull_init_hctx,
+	.exit_hctx	= sbull_exit_hctx,
+};
+
+static const struct blk_mq_ops sbull_full_ops = {
+	.queue_rq	= sbull_full_request,
+	.complete	= sbull_complete,
+	.init_request	= sbull_init_request,
+	.init_hctx	= sbull_init_hctx,
+	.exit_hctx	= sbull_exit_hctx,
+};
+
+static const struct blk_mq_ops sbull_mq_ops = {
+	.queue_rq	= sbull_mq_request,
+	.complete	= sbull_complete,
+	.init_request	= sbull_init_request,
+	.init_hctx	= sbull_init_hctx,
+	.exit_hctx	= sbull_exit_hctx,
+	.map_queues	= sbull_map_queues,
+	.poll		= sbull_poll,
+};
+
+static const struct blk_mq_ops sbull_file_ops = {
+	.queue_rq	= sbull_file_request,
+	.complete	= sbull_complete,
+	.init_request	= sbull_init_request,
+	.init_hctx	= sbull_init_hctx,
+	.exit_hctx	= sbull_exit_hctx,
+	.map_queues	= sbull_map_queues,
+};
+
+
+
+/*
+ * The direct make request version.
+ */
+static blk_qc_t sbull_make_request(struct bio *bio)
+{
+	struct sbull_dev *dev = bio->bi_disk->private_data;
+	int status;
+
+	status = sbull_xfer_bio(dev, bio, GFP_NOIO);
+	bio->bi_status = errno_to_blk_status(status);
+	bio_endio(bio);
+	return BLK_QC_T_NONE;
+}
+
+
+/*
+ * Revalidate: the new media is blank, so start a new generation of
+ * pages, and empty the cache and the zones. WE DO NOT
+ * TAKE THE LOCK HERE, for fear of deadlocking with open.  That needs
+ * to be reevaluated.
+ */
+static void sbull_revalidate(struct gendisk *gd)
+{
+	struct sbull_dev *dev = gd->private_data;
+
+	if (dev->media_change) {
+		dev->media_change = 0;
+		sbull_cache_crash(dev);
+		sbull_zoned_reset_all(dev);
+		WRITE_ONCE(dev->generation, dev->generation + 1);
+		schedule_work(&dev->reclaim);
+	}
+}
+
+/*
+ * Open and close.
+ */
+
+static int sbull_open(struct block_device *bdev, fmode_t mode)
+{
+	struct sbull_dev *dev = bdev->bd_disk->private_data;
+	int first;
+
+	del_timer_sync(&dev->timer);
+	spin_lock_bh(&dev->lock);
+	first = !dev->users++;
+	spin_unlock_bh(&dev->lock);
+	if (first && bdev_check_media_change(bdev))
+		sbull_revalidate(bdev->bd_disk);
+	return 0;
+}
+
+static void sbull_release(struct gendisk *gd, fmode_t mode)
+{
+	struct sbull_dev *dev = gd->private_data;
+
+	spin_lock_bh(&dev->lock);
+	dev->users--;
+
+	if (!dev->users)
+		mod_timer(&dev->timer, jiffies + INVALIDATE_DELAY);
+	spin_unlock_bh(&dev->lock);
+}
+
+/*
+ * Look for a (simulated) media change.
+ */
+static unsigned int sbull_check_events(struct gendisk *gd, unsigned int clearing)
+{
+	struct sbull_dev *dev = gd->private_data;
+
+	return dev->media_change ? DISK_EVENT_MEDIA_CHANGE : 0;
+}
+
+/*
+ * The "invalidate" function runs out of the device timer; it sets
+ * a flag to simulate the removal of the media.
+ */
+static void sbull_invalidate(struct timer_list *t)
+{
+	struct sbull_dev *dev = from_timer(dev, t, timer);
+
+	spin_lock(&dev->lock);
+	if (dev->users)
+		printk (KERN_WARNING "sbull: timer sanity check failed\n");
+	else
+		dev->media_change = 1;
+	spin_unlock(&dev->lock);
+}
+
+/*
+ * The ioctl() implementation. Geometry is handled by getgeo.
+ */
+static int sbull_ioctl(struct block_device *bdev, fmode_t mode,
+		unsigned int cmd, unsigned long arg)
+{
+	struct sbull_dev *dev = bdev->bd_disk->private_data;
+
+	switch (cmd) {
+	    case SBULL_IOCCRASH:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		sbull_cache_crash(dev);
+		/* and what the page cache has is stale now */
+		invalidate_bdev(bdev);
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+/*
+ * Get geometry: since we are a virtual device, we have to make
+ * up something plausible.  So we claim 16 sectors, four heads,
+ * and calculate the corresponding number of cylinders.  We set the
+ * start of data at sector four.
+ */
+static int sbull_getgeo(struct block_device *bdev, struct hd_geometry *geo)
+{
+	sector_t size = get_capacity(bdev->bd_disk);
+
+	geo->cylinders = (size & ~0x3f) >> 6;
+	geo->heads = 4;
+	geo->sectors = 16;
+	geo->start = 4;
+	return 0;
+}
+
+
+
+/*
+ * The device operations structure. RM_NOQUEUE devices get their bios
+ * straight from submit_bio, the others go through blk-mq.
+ */
+static const struct block_device_operations sbull_ops = {
+	.owner           = THIS_MODULE,
+	.open 	         = sbull_open,
+	.release 	 = sbull_release,
+	.ioctl	         = sbull_ioctl,
+	.check_events    = sbull_check_events,
+	.getgeo	         = sbull_getgeo,
+	.report_zones    = sbull_report_zones,
+};
+
+static const struct block_device_operations sbull_bio_ops = {
+	.owner           = THIS_MODULE,
+	.submit_bio      = sbull_make_request,
+	.open 	         = sbull_open,
+	.release 	 = sbull_release,
+	.ioctl	         = sbull_ioctl,
+	.check_events    = sbull_check_events,
+	.getgeo	         = sbull_getgeo,
+};
+
+
+static const struct attribute_group *sbull_attr_groups[] = {
+	&sbull_emul_attr_group,
+	NULL
+};
+
+/*
+ * Set up a blk-mq queue with its own tag set.
+ */
+static struct request_queue *sbull_init_mq(struct sbull_dev *dev,
+		const struct blk_mq_ops *ops, int nr_hw_queues)
+{
+	struct blk_mq_tag_set *set = &dev->tag_set;
+	struct request_queue *q;
+
+	set->ops = ops;
+	set->nr_hw_queues = nr_hw_queues;
+	set->nr_maps = poll_queues && !dev->file ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = queue_depth;
+	set->cmd_size = sizeof(struct sbull_cmd);
+	set->numa_node = NUMA_NO_NODE;
+	set->flags = BLK_MQ_F_SHOULD_MERGE;
+	if (dev->file)
+		set->flags |= BLK_MQ_F_BLOCKING;	/* see file.c */
+	if (blk_mq_alloc_tag_set(set))
+		return NULL;
+	q = blk_mq_init_queue_data(set, dev);
+	if (IS_ERR(q)) {
+		blk_mq_free_tag_set(set);
+		return NULL;
+	}
+	return q;
+}
+
+static int sbull_nr_hw_queues(void)
+{
+	if (hw_queues > 0)
+		return min_t(int, hw_queues, nr_cpu_ids);
+	return queue_map == QM_NODE ? num_online_nodes() : nr_cpu_ids;
+}
+
+/*
+ * Set up our internal device.
+ */
+static void setup_device(struct sbull_dev *dev, int which)
+{
+	memset (dev, 0, sizeof (struct sbull_dev));
+	spin_lock_init(&dev->lock);
+
+	/*
+	 * The timer which "invalidates" the device.
+	 */
+	timer_setup(&dev->timer, sbull_invalidate, 0);
+
+	/*
+	 * No data yet: pages come with the first writes.
+	 */
+	dev->size = (u64)nsectors*hardsect_size;
+	xa_init(&dev->pages);
+	INIT_WORK(&dev->reclaim, sbull_reclaim);
+
+	dev->emul.latency_ns = latency_ns;
+	dev->emul.jitter_ns = jitter_ns;
+	dev->emul.slow_ns = slow_ns;
+	dev->emul.slow_permille = clamp(slow_permille, 0, 1000);
+	dev->emul.iops_limit = iops_limit;
+	dev->emul.bw_limit = bw_limit;
+	dev->emul.flush_ns = flush_ns;
+
+	/*
+	 * A backing file, if there is one for us; only blk-mq can wait
+	 * for it, and then it takes its own request function.
+	 */
+	if (request_mode != RM_NOQUEUE && sbull_file_open(dev, which))
+		return;
+
+	/*
+	 * The I/O queue, depending on whether we are using our own
+	 * make_request function or not.
+	 */
+	if (dev->file)
+		dev->queue = sbull_init_mq(dev, &sbull_file_ops,
+				request_mode == RM_MQ ? sbull_nr_hw_queues() : 1);
+	else switch (request_mode) {
+	    case RM_NOQUEUE:
+		dev->queue = blk_alloc_queue(NUMA_NO_NODE);
+		break;
+
+	    case RM_MQ:
+		dev->queue = sbull_init_mq(dev, &sbull_mq_ops,
+				sbull_nr_hw_queues() + poll_queues);
+		break;
+
+	    case RM_FULL:
+		dev->queue = sbull_init_mq(dev, &sbull_full_ops, 1);
+		break;
+
+	    case RM_SIMPLE:
+		dev->queue = sbull_init_mq(dev, &sbull_simple_ops, 1);
+		break;
+	}
+	if (dev->queue == NULL)
+		goto out_file;
+	blk_queue_logical_block_size(dev->queue, hardsect_size);
+	/*
+	 * Any memory will do: big requests, in segments as big as the
+	 * pages allow.
+	 */
+	blk_queue_max_hw_sectors(dev->queue, SBULL_MAX_SECTORS);
+	blk_queue_max_segments(dev->queue, USHRT_MAX);
+	blk_queue_max_segment_size(dev->queue, UINT_MAX);
+	/*
+	 * Discards give the memory back; see sbull_discard().
+	 */
+	dev->queue->limits.discard_granularity = hardsect_size;
+	blk_queue_max_discard_sectors(dev->queue, SBULL_MAX_DISCARD);
+	blk_queue_max_write_zeroes_sectors(dev->queue, SBULL_MAX_DISCARD);
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->queue);
+	blk_queue_flag_set(QUEUE_FLAG_SECERASE, dev->queue);
+	blk_queue_flag_set(QUEUE_FLAG_NONROT, dev->queue);
+	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, dev->queue);
+	dev->queue->queuedata = dev;
+	if (dev->file)
+		sbull_file_setup_queue(dev);
+	if (sbull_cache_init(dev))
+		goto out_queue;
+	/*
+	 * And the gendisk structure.
+	 */
+	dev->gd = alloc_disk(SBULL_MINORS);
+	if (! dev->gd) {
+		printk (KERN_NOTICE "alloc_disk failure\n");
+		goto out_queue;
+	}
+	dev->gd->major = sbull_major;
+	dev->gd->first_minor = which*SBULL_MINORS;
+	dev->gd->fops = request_mode == RM_NOQUEUE ? &sbull_bio_ops : &sbull_ops;
+	dev->gd->events = DISK_EVENT_MEDIA_CHANGE;
+	dev->gd->queue = dev->queue;
+	dev->gd->private_data = dev;
+	snprintf (dev->gd->disk_name, 32, "sbull%c", which + 'a');
+	set_capacity(dev->gd, dev->size/KERNEL_SECTOR_SIZE);
+	if (sbull_zoned_init(dev)) {
+		put_disk(dev->gd);
+		dev->gd = NULL;
+		goto out_queue;
+	}
+	device_add_disk(NULL, dev->gd, sbull_attr_groups);
+	return;
+
+  out_queue:
+	blk_cleanup_queue(dev->queue);
+	if (request_mode != RM_NOQUEUE)
+		blk_mq_free_tag_set(&dev->tag_set);
+	dev->queue = NULL;
+	sbull_cache_cleanup(dev);
+  out_file:
+	sbull_file_close(dev);
+}
+
+
+
+static int __init sbull_init(void)
+{
+	int i;
+
+	switch (request_mode) {
+	    case RM_SIMPLE:
+	    case RM_FULL:
+	    case RM_NOQUEUE:
+	    case RM_MQ:
+		break;
+	    default:
+		printk(KERN_NOTICE "Bad request mode %d, using simple\n", request_mode);
+		request_mode = RM_SIMPLE;
+	}
+	if (request_mode == RM_NOQUEUE &&
+	    (latency_ns || jitter_ns || slow_ns || iops_limit || bw_limit ||
+	     flush_ns))
+		printk(KERN_NOTICE "sbull: no timing emulation without a request queue\n");
+	if (poll_queues && request_mode != RM_MQ) {
+		printk(KERN_NOTICE "sbull: poll queues need request_mode %d\n", RM_MQ);
+		poll_queues = 0;
+	}
+	poll_queues = clamp_t(int, poll_queues, 0, nr_cpu_ids);
+	if (hardsect_size < KERNEL_SECTOR_SIZE || hardsect_size > PAGE_SIZE ||
+	    !is_power_of_2(hardsect_size)) {
+		printk(KERN_WARNING "sbull: bad hardsect_size %d\n", hardsect_size);
+		return -EINVAL;
+	}
+	if (queue_depth <= 0 || queue_map < QM_CPU || queue_map > QM_NODE) {
+		printk(KERN_WARNING "sbull: bad queue_depth or queue_map\n");
+		return -EINVAL;
+	}
+	/*
+	 * Get registered.
+	 */
+	sbull_major = register_blkdev(sbull_major, "sbull");
+	if (sbull_major <= 0) {
+		printk(KERN_WARNING "sbull: unable to get major number\n");
+		return -EBUSY;
+	}
+	/*
+	 * Allocate the device array, and initialize each one.
+	 */
+	Devices = kmalloc(ndevices*sizeof (struct sbull_dev), GFP_KERNEL);
+	if (Devices == NULL)
+		goto out_unregister;
+	for (i = 0; i < ndevices; i++)
+		setup_device(Devices + i, i);
+
+	return 0;
+
+  out_unregister:
+	unregister_blkdev(sbull_major, "sbull");
+	return -ENOMEM;
+}
+
+static void sbull_exit(void)
+{
+	int i;
+
+	for (i = 0; i < ndevices; i++) {
+		struct sbull_dev *dev = Devices + i;
+
+		del_timer_sync(&dev->timer);
+		if (dev->gd) {
+			del_gendisk(dev->gd);
+			put_disk(dev->gd);
+		}
+		if (dev->queue) {
+			blk_cleanup_queue(dev->queue);
+			if (request_mode != RM_NOQUEUE)
+				blk_mq_free_tag_set(&dev->tag_set);
+		}
+		sbull_zoned_cleanup(dev);
+		sbull_cache_cleanup(dev);
+		sbull_file_close(dev);
+		cancel_work_sync(&dev->reclaim);
+		sbull_free_pages(dev);
+	}
+	rcu_barrier();	/* for discarded pages */
+	unregister_blkdev(sbull_major, "sbull");
+	kfree(Devices);
+}
+
+module_init(sbull_init);
+module_exit(sbull_exit);
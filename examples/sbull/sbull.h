@@ -1,6 +1,6 @@
 
 /*
- * sbull.h -- definitions for the char module
+ * sbull.h -- definitions for the block module
  *
  * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
  * Copyright (C) 2001 O'Reilly & Associates
@@ -15,13 +15,18 @@
  *
  */
 
+#ifndef _SBULL_H_
+#define _SBULL_H_
 
 #include <linux/ioctl.h>
-
-/* Multiqueue only works on 2.4 */
-#ifdef SBULL_MULTIQUEUE
-#    warning "Multiqueue only works on 2.4 kernels"
-#endif
+#include <linux/fs.h>		/* struct kiocb */
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/blk-mq.h>
 
 /*
  * Macros to help debugging
@@ -43,29 +48,130 @@
 #undef PDEBUGG
 #define PDEBUGG(fmt, args...) /* nothing: it's a placeholder */
 
+/*
+ * We can tweak our hardware sector size, but the kernel talks to us
+ * in terms of small sectors, always.
+ */
+#define KERNEL_SECTOR_SIZE	512
+
+/*
+ * Device timing emulation (emul.c). All zeros means none: requests
+ * complete as soon as their data is copied.
+ */
+struct sbull_emul {
+	u64 latency_ns;			/* Base completion latency */
+	u64 jitter_ns;			/* Uniformly spread, +/- */
+	u64 slow_ns;			/* Added to the slow ones... */
+	u64 slow_permille;		/* ...which are this many */
+	u64 iops_limit;			/* Caps; 0 for none */
+	u64 bw_limit;			/* MiB/s */
+	u64 flush_ns;			/* Added to flushes and FUA writes */
+	atomic64_t busy_until;		/* The caps keep us busy until then */
+};
+
+/*
+ * The internal representation of our device.
+ */
+struct sbull_dev {
+        u64 size;                       /* Device size in bytes */
+        struct xarray pages;            /* The data, by page number */
+        unsigned long generation;       /* Of the media; see main.c */
+        struct work_struct reclaim;     /* Frees the older ones' pages */
+        short users;                    /* How many users */
+        short media_change;             /* Flag a media change? */
+        spinlock_t lock;                /* For mutual exclusion */
+        struct request_queue *queue;    /* The device request queue */
+        struct gendisk *gd;             /* The gendisk structure */
+        struct timer_list timer;        /* For simulated media changes */
+        struct blk_mq_tag_set tag_set;  /* All but RM_NOQUEUE */
+        struct sbull_emul emul;         /* Pretend to be a slower disk */
+        struct sbull_zoned *zoned;      /* The zones, if any (zoned.c) */
+        struct sbull_cache *cache;      /* Write cache, if any (cache.c) */
+        struct file *file;              /* Backing file, if any (file.c) */
+};
 
-#define SBULL_MAJOR 0       /* dynamic major by default */
-#define SBULL_DEVS 2        /* two disks */
-#define SBULL_RAHEAD 2      /* two sectors */
-#define SBULL_SIZE 2048     /* two megs each */
-#define SBULL_BLKSIZE 1024  /* 1k blocks */
-#define SBULL_HARDSECT 512  /* 2.2 and 2.4 can used different values */
+/*
+ * What we keep with every request (the blk-mq "pdu").
+ */
+struct sbull_cmd {
+	struct hrtimer timer;		/* Completes it, when emulating */
+	struct list_head list;		/* On a poll queue, waiting to be reaped */
+	u64 deadline;			/* ... from then on */
+	blk_status_t status;
+	struct kiocb iocb;		/* File-backed disks: the file I/O */
+	struct bio_vec *bvec;		/* ...its own bvecs, if it needs some */
+	atomic_t ref;
+	long ret;
+};
 
-#define SBULLR_MAJOR 0      /* Dynamic major for raw device */
 /*
- * The sbull device is removable: if it is left closed for more than
- * half a minute, it is removed. Thus use a usage count and a
- * kernel timer
+ * Prototypes for shared functions
  */
 
-typedef struct Sbull_Dev {
-   int size;
-   int usage;
-   struct timer_list timer;
-   spinlock_t lock;
-   u8 *data;
-#ifdef SBULL_MULTIQUEUE
-   request_queue_t *queue;
-   int busy;
+bool     sbull_emul_active(struct sbull_dev *dev);
+u64      sbull_emul_deadline(struct sbull_dev *dev, struct request *req);
+void     sbull_emul_end(struct sbull_dev *dev, struct request *req,
+		blk_status_t status);
+void     sbull_emul_init_cmd(struct sbull_cmd *cmd);
+
+extern const struct attribute_group sbull_emul_attr_group;	/* emul.c */
+
+void     sbull_free_page_rcu(struct rcu_head *head);
+struct page *sbull_disk_page(struct sbull_dev *dev, pgoff_t index);
+int      sbull_check_range(struct sbull_dev *dev, sector_t sector, u64 nbytes);
+int      sbull_discard(struct sbull_dev *dev, sector_t sector, u64 nbytes,
+		int flags);
+int      sbull_xfer_rq_at(struct sbull_dev *dev, struct request *req,
+		sector_t sector, gfp_t gfp);
+
+int      sbull_file_open(struct sbull_dev *dev, int which);
+void     sbull_file_close(struct sbull_dev *dev);
+void     sbull_file_setup_queue(struct sbull_dev *dev);
+blk_status_t sbull_file_request(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd);
+
+struct page *sbull_cache_find(struct sbull_dev *dev, pgoff_t index);
+bool     sbull_cache_room(struct sbull_dev *dev);
+int      sbull_cache_insert(struct sbull_dev *dev, pgoff_t index, gfp_t gfp);
+int      sbull_cache_flush(struct sbull_dev *dev);
+int      sbull_cache_sync(struct sbull_dev *dev, sector_t sector, u64 nbytes);
+int      sbull_cache_fua(struct sbull_dev *dev, unsigned int opf,
+		sector_t sector, u64 nbytes);
+void     sbull_cache_crash(struct sbull_dev *dev);
+int      sbull_cache_init(struct sbull_dev *dev);
+void     sbull_cache_cleanup(struct sbull_dev *dev);
+
+#ifdef CONFIG_BLK_DEV_ZONED
+int      sbull_zoned_init(struct sbull_dev *dev);
+void     sbull_zoned_cleanup(struct sbull_dev *dev);
+void     sbull_zoned_reset_all(struct sbull_dev *dev);
+int      sbull_zoned_rq(struct sbull_dev *dev, struct request *req, gfp_t gfp);
+int      sbull_report_zones(struct gendisk *gd, sector_t sector,
+		unsigned int nr_zones, report_zones_cb cb, void *data);
+#else
+static inline int sbull_zoned_init(struct sbull_dev *dev) { return 0; }
+static inline void sbull_zoned_cleanup(struct sbull_dev *dev) { }
+static inline void sbull_zoned_reset_all(struct sbull_dev *dev) { }
+static inline int sbull_zoned_rq(struct sbull_dev *dev, struct request *req,
+		gfp_t gfp)
+{
+	return -EOPNOTSUPP;
+}
+#define sbull_report_zones NULL
 #endif
-}              Sbull_Dev;
+
+/*
+ * Ioctl definitions
+ */
+
+/* Use 'b' as magic number */
+#define SBULL_IOC_MAGIC  'b'
+
+/*
+ * Drop what the write cache holds, as a power cut would.
+ */
+#define SBULL_IOCCRASH   _IO(SBULL_IOC_MAGIC, 0)
+
+#define SBULL_IOC_MAXNR 0
+
+#endif /* _SBULL_H_ */
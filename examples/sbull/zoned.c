@@ -0,0 +1,516 @@
+/*
+ * zoned.c -- sbull as a host-managed zoned disk
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * With zoned=1 the disk is cut into zones of zone_size MiB. The first
+ * zone_nr_conv zones are conventional, and can be written anywhere;
+ * the others must be written sequentially, at their write pointer,
+ * and only up to their capacity (zone_capacity MiB, which may be less
+ * than the size, as on ZNS drives). A write anywhere else fails, as it
+ * would on the drive; so does a write to a full zone.
+ *
+ * Zones open implicitly when written, or explicitly, and stay active
+ * (open or closed) until they are full or reset. There can be no more
+ * than zone_max_open open zones and zone_max_active active ones (0 for
+ * no limit): when a write needs one more open zone, an implicitly open
+ * one is closed to make room, if there is any; otherwise the request
+ * fails with BLK_STS_ZONE_OPEN_RESOURCE or ZONE_ACTIVE_RESOURCE.
+ *
+ * Resetting a zone gives its pages back. Reads work anywhere, and
+ * return zeros above the write pointer.
+ *
+ * All the zone state, and the writes to sequential zones, are under
+ * a single lock per disk. Reads, and writes to conventional zones,
+ * don't take it.
+ *
+ * A reset empties its zones at once, but giving their pages back can
+ * take long: millions of them for a reset of all the zones of a big
+ * disk. A worker does it, a zone at a time, and completes the request
+ * when done. Writes to those zones, and other resets, go back to
+ * blk-mq meanwhile, to be retried.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>		/* kvcalloc() */
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/genhd.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+
+#include "sbull.h"
+
+static bool zoned = false;
+module_param(zoned, bool, 0);
+static unsigned long zone_size = 64;	/* MiB, a power of two */
+module_param(zone_size, ulong, 0);
+static unsigned long zone_capacity = 0;	/* MiB, 0 for the whole zone */
+module_param(zone_capacity, ulong, 0);
+static unsigned int zone_nr_conv = 0;
+module_param(zone_nr_conv, uint, 0);
+static unsigned int zone_max_open = 0;
+module_param(zone_max_open, uint, 0);
+static unsigned int zone_max_active = 0;
+module_param(zone_max_active, uint, 0);
+
+#define MiB_SECTORS(mb)	((sector_t)(mb) << (20 - SECTOR_SHIFT))
+
+struct sbull_zone {
+	sector_t start;
+	sector_t wp;			/* The write pointer */
+	enum blk_zone_cond cond;
+	bool conv;			/* A conventional zone */
+	bool discarding;		/* Reset, pages not given back yet */
+};
+
+struct sbull_zoned {
+	spinlock_t lock;
+	struct sbull_zone *zones;
+	unsigned int nr_zones;
+	unsigned int shift;		/* Of the zone size, in sectors */
+	sector_t len, capacity;		/* In sectors */
+	unsigned int max_open, max_active;
+	unsigned int nr_imp_open, nr_exp_open, nr_closed;
+	unsigned int next_close;	/* Where to look for a zone to close */
+	struct request *reset_req;	/* The reset the worker is doing */
+	struct work_struct discard;
+	struct sbull_dev *dev;
+};
+
+static struct sbull_zone *sbull_zone_of(struct sbull_zoned *zd, sector_t sector)
+{
+	return &zd->zones[sector >> zd->shift];
+}
+
+/*
+ * Change the condition of a zone, keeping the counts right.
+ */
+static void sbull_zone_count(struct sbull_zoned *zd, enum blk_zone_cond cond,
+		int delta)
+{
+	switch (cond) {
+	    case BLK_ZONE_COND_IMP_OPEN:
+		zd->nr_imp_open += delta;
+		break;
+	    case BLK_ZONE_COND_EXP_OPEN:
+		zd->nr_exp_open += delta;
+		break;
+	    case BLK_ZONE_COND_CLOSED:
+		zd->nr_closed += delta;
+		break;
+	    default:
+		break;
+	}
+}
+
+static void sbull_zone_set_cond(struct sbull_zoned *zd, struct sbull_zone *zone,
+		enum blk_zone_cond cond)
+{
+	sbull_zone_count(zd, zone->cond, -1);
+	zone->cond = cond;
+	sbull_zone_count(zd, cond, 1);
+}
+
+/*
+ * Closing an open zone takes it back to empty if it was never written.
+ */
+static void sbull_zone_close(struct sbull_zoned *zd, struct sbull_zone *zone)
+{
+	sbull_zone_set_cond(zd, zone, zone->wp == zone->start ?
+			BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED);
+}
+
+/*
+ * Make room for one more open zone by closing an implicitly open one,
+ * taking turns among them.
+ */
+static bool sbull_zone_close_implicit(struct sbull_zoned *zd)
+{
+	unsigned int i, n;
+
+	if (!zd->nr_imp_open)
+		return false;
+	for (i = 0; i < zd->nr_zones; i++) {
+		n = (zd->next_close + i) % zd->nr_zones;
+		if (zd->zones[n].cond == BLK_ZONE_COND_IMP_OPEN) {
+			sbull_zone_close(zd, &zd->zones[n]);
+			zd->next_close = n + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Check that an empty or closed zone can be opened. The errors are
+ * those of the block layer for BLK_STS_ZONE_{ACTIVE,OPEN}_RESOURCE.
+ */
+static int sbull_zone_can_open(struct sbull_zoned *zd, struct sbull_zone *zone)
+{
+	if (zd->max_active && zone->cond == BLK_ZONE_COND_EMPTY &&
+	    zd->nr_imp_open + zd->nr_exp_open + zd->nr_closed >= zd->max_active)
+		return -EOVERFLOW;
+	if (zd->max_open && zd->nr_imp_open + zd->nr_exp_open >= zd->max_open &&
+	    !sbull_zone_close_implicit(zd))
+		return -ETOOMANYREFS;
+	return 0;
+}
+
+/*
+ * A write, or a zone append, to a sequential zone; called with the
+ * lock held. The data goes in before the write pointer moves, so a
+ * write that runs out of memory can simply be retried.
+ */
+static int sbull_zone_write(struct sbull_dev *dev, struct sbull_zone *zone,
+		struct request *req, gfp_t gfp)
+{
+	struct sbull_zoned *zd = dev->zoned;
+	sector_t sector = blk_rq_pos(req), nr = blk_rq_sectors(req);
+	int err;
+
+	if (zone->discarding)
+		return -ENOMEM;	/* retried once the reset is done */
+	if (zone->cond == BLK_ZONE_COND_FULL)
+		return -EIO;
+	if (req_op(req) == REQ_OP_ZONE_APPEND)
+		sector = zone->wp;
+	else if (sector != zone->wp)
+		return -EIO;	/* not sequential */
+	if (sector + nr > zone->start + zd->capacity)
+		return -EIO;
+
+	if (zone->cond == BLK_ZONE_COND_EMPTY ||
+	    zone->cond == BLK_ZONE_COND_CLOSED) {
+		err = sbull_zone_can_open(zd, zone);
+		if (err)
+			return err;
+		sbull_zone_set_cond(zd, zone, BLK_ZONE_COND_IMP_OPEN);
+	}
+	err = sbull_xfer_rq_at(dev, req, sector, gfp);
+	if (err)
+		return err;
+	if (req_op(req) == REQ_OP_ZONE_APPEND)
+		req->__sector = sector;	/* tell the submitter where it went */
+	zone->wp += nr;
+	if (zone->wp == zone->start + zd->capacity) {
+		sbull_zone_set_cond(zd, zone, BLK_ZONE_COND_FULL);
+		zone->wp = zone->start + zd->len;
+	}
+	return 0;
+}
+
+/*
+ * Empty a zone; its pages are for the worker to free, unless a media
+ * change already made them stale. Called with the lock held.
+ */
+static void sbull_zone_reset(struct sbull_zoned *zd, struct sbull_zone *zone,
+		bool discard)
+{
+	if (zone->cond == BLK_ZONE_COND_EMPTY)
+		return;
+	sbull_zone_set_cond(zd, zone, BLK_ZONE_COND_EMPTY);
+	zone->wp = zone->start;
+	if (discard)
+		zone->discarding = true;
+}
+
+/*
+ * The worker: free the pages of the zones just reset, with a break
+ * between zones, then complete the reset.
+ */
+static void sbull_zoned_discard(struct work_struct *work)
+{
+	struct sbull_zoned *zd = container_of(work, struct sbull_zoned,
+			discard);
+	struct sbull_dev *dev = zd->dev;
+	struct request *req;
+	unsigned int i;
+	int err = 0, ret;
+
+	for (i = 0; i < zd->nr_zones; i++) {
+		if (!READ_ONCE(zd->zones[i].discarding))
+			continue;
+		ret = sbull_discard(dev, zd->zones[i].start,
+				(u64)zd->len << SECTOR_SHIFT, 0);
+		if (ret && !err)
+			err = ret;
+		spin_lock(&zd->lock);
+		zd->zones[i].discarding = false;
+		spin_unlock(&zd->lock);
+		cond_resched();
+	}
+
+	spin_lock(&zd->lock);
+	req = zd->reset_req;
+	zd->reset_req = NULL;
+	spin_unlock(&zd->lock);
+	if (sbull_emul_active(dev))
+		sbull_emul_end(dev, req, errno_to_blk_status(err));
+	else
+		blk_mq_end_request(req, errno_to_blk_status(err));
+}
+
+/*
+ * REQ_OP_ZONE_RESET, for "zone", or REQ_OP_ZONE_RESET_ALL, for a NULL
+ * one. The request completes from the worker.
+ */
+static int sbull_zoned_reset(struct sbull_dev *dev, struct request *req,
+		struct sbull_zone *zone)
+{
+	struct sbull_zoned *zd = dev->zoned;
+	unsigned int i;
+
+	spin_lock(&zd->lock);
+	if (zd->reset_req) {
+		spin_unlock(&zd->lock);
+		return -ENOMEM;	/* one at a time: blk-mq retries it */
+	}
+	if (zone)
+		sbull_zone_reset(zd, zone, true);
+	else
+		for (i = 0; i < zd->nr_zones; i++)
+			if (!zd->zones[i].conv)
+				sbull_zone_reset(zd, &zd->zones[i], true);
+	zd->reset_req = req;
+	spin_unlock(&zd->lock);
+	schedule_work(&zd->discard);
+	return -EINPROGRESS;
+}
+
+/*
+ * Zone management: open, close and finish; called with the lock held.
+ */
+static int sbull_zone_mgmt(struct sbull_dev *dev, struct sbull_zone *zone,
+		unsigned int op)
+{
+	struct sbull_zoned *zd = dev->zoned;
+	int err;
+
+	switch (op) {
+	    case REQ_OP_ZONE_OPEN:
+		switch (zone->cond) {
+		    case BLK_ZONE_COND_EXP_OPEN:
+			return 0;
+		    case BLK_ZONE_COND_EMPTY:
+		    case BLK_ZONE_COND_CLOSED:
+			err = sbull_zone_can_open(zd, zone);
+			if (err)
+				return err;
+			/* fall through */
+		    case BLK_ZONE_COND_IMP_OPEN:
+			sbull_zone_set_cond(zd, zone, BLK_ZONE_COND_EXP_OPEN);
+			return 0;
+		    default:
+			return -EIO;
+		}
+
+	    case REQ_OP_ZONE_CLOSE:
+		switch (zone->cond) {
+		    case BLK_ZONE_COND_CLOSED:
+			return 0;
+		    case BLK_ZONE_COND_IMP_OPEN:
+		    case BLK_ZONE_COND_EXP_OPEN:
+			sbull_zone_close(zd, zone);
+			return 0;
+		    default:
+			return -EIO;
+		}
+
+	    case REQ_OP_ZONE_FINISH:
+		sbull_zone_set_cond(zd, zone, BLK_ZONE_COND_FULL);
+		zone->wp = zone->start + zd->len;
+		return 0;
+	}
+	return -EOPNOTSUPP;
+}
+
+/*
+ * Reset all the sequential zones when the media changes; the pages are
+ * stale already, and go with their generation.
+ */
+void sbull_zoned_reset_all(struct sbull_dev *dev)
+{
+	struct sbull_zoned *zd = dev->zoned;
+	unsigned int i;
+
+	if (!zd)
+		return;
+	spin_lock(&zd->lock);
+	for (i = 0; i < zd->nr_zones; i++)
+		if (!zd->zones[i].conv)
+			sbull_zone_reset(zd, &zd->zones[i], false);
+	spin_unlock(&zd->lock);
+}
+
+/*
+ * Handle any request to a zoned disk.
+ */
+int sbull_zoned_rq(struct sbull_dev *dev, struct request *req, gfp_t gfp)
+{
+	struct sbull_zoned *zd = dev->zoned;
+	struct sbull_zone *zone;
+	unsigned int op = req_op(req);
+	int err;
+
+	err = sbull_check_range(dev, blk_rq_pos(req), blk_rq_bytes(req));
+	if (err)
+		return err;
+	if (op == REQ_OP_FLUSH)
+		return sbull_cache_flush(dev);
+	if ((blk_rq_pos(req) >> zd->shift) >= zd->nr_zones)
+		return -EIO;	/* a zone operation past the end */
+	zone = sbull_zone_of(zd, blk_rq_pos(req));
+	if (op == REQ_OP_READ ||
+	    (op == REQ_OP_WRITE && zone->conv))
+		return sbull_xfer_rq_at(dev, req, blk_rq_pos(req), gfp);
+	if (op == REQ_OP_ZONE_RESET_ALL)
+		return sbull_zoned_reset(dev, req, NULL);
+	if (zone->conv)
+		return -EIO;	/* appends and zone operations */
+	if (op == REQ_OP_ZONE_RESET)
+		return sbull_zoned_reset(dev, req, zone);
+
+	spin_lock(&zd->lock);
+	if (op == REQ_OP_WRITE || op == REQ_OP_ZONE_APPEND)
+		err = sbull_zone_write(dev, zone, req, gfp);
+	else
+		err = sbull_zone_mgmt(dev, zone, op);
+	spin_unlock(&zd->lock);
+	return err;
+}
+
+int sbull_report_zones(struct gendisk *gd, sector_t sector,
+		unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+	struct sbull_dev *dev = gd->private_data;
+	struct sbull_zoned *zd = dev->zoned;
+	unsigned int first = sector >> zd->shift, i;
+	struct sbull_zone *zone;
+	struct blk_zone blkz;
+	int err;
+
+	for (i = 0; i < nr_zones && first + i < zd->nr_zones; i++) {
+		zone = &zd->zones[first + i];
+		memset(&blkz, 0, sizeof(blkz));
+		blkz.start = zone->start;
+		blkz.len = zd->len;
+		if (zone->conv) {
+			blkz.type = BLK_ZONE_TYPE_CONVENTIONAL;
+			blkz.cond = BLK_ZONE_COND_NOT_WP;
+			blkz.wp = (sector_t)-1;
+			blkz.capacity = zd->len;
+		} else {
+			blkz.type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			blkz.capacity = zd->capacity;
+			spin_lock(&zd->lock);
+			blkz.cond = zone->cond;
+			blkz.wp = zone->wp;
+			spin_unlock(&zd->lock);
+		}
+		err = cb(&blkz, i, data);
+		if (err)
+			return err;
+	}
+	return i;
+}
+
+/*
+ * Make a new disk zoned, if asked to; called once its gendisk is ready,
+ * but before it is added. The size is rounded down to whole zones.
+ */
+int sbull_zoned_init(struct sbull_dev *dev)
+{
+	struct request_queue *q = dev->queue;
+	struct sbull_zoned *zd;
+	unsigned int i;
+	int err;
+
+	if (!zoned || dev->file)
+		return 0;
+	if (!queue_is_mq(q)) {
+		printk(KERN_NOTICE "sbull: zoned disks need a request queue\n");
+		return 0;
+	}
+	if (!zone_size || !is_power_of_2(zone_size) ||
+	    zone_capacity > zone_size ||
+	    dev->size < ((u64)zone_size << 20) * (zone_nr_conv + 1)) {
+		printk(KERN_WARNING "sbull: bad zone_size, zone_capacity or zone_nr_conv\n");
+		return -EINVAL;
+	}
+
+	zd = kzalloc(sizeof(*zd), GFP_KERNEL);
+	if (!zd)
+		return -ENOMEM;
+	spin_lock_init(&zd->lock);
+	INIT_WORK(&zd->discard, sbull_zoned_discard);
+	zd->dev = dev;
+	zd->len = MiB_SECTORS(zone_size);
+	zd->capacity = zone_capacity ? MiB_SECTORS(zone_capacity) : zd->len;
+	zd->shift = ilog2(zd->len);
+	zd->nr_zones = (dev->size >> SECTOR_SHIFT) >> zd->shift;
+	zd->max_active = min(zone_max_active, zd->nr_zones - zone_nr_conv);
+	zd->max_open = min(zone_max_open, zd->nr_zones - zone_nr_conv);
+	if (zd->max_active)
+		zd->max_open = min(zd->max_open ? zd->max_open : UINT_MAX,
+				zd->max_active);
+	zd->zones = kvcalloc(zd->nr_zones, sizeof(*zd->zones), GFP_KERNEL);
+	if (!zd->zones) {
+		kfree(zd);
+		return -ENOMEM;
+	}
+	for (i = 0; i < zd->nr_zones; i++) {
+		zd->zones[i].start = (sector_t)i << zd->shift;
+		zd->zones[i].wp = zd->zones[i].start;
+		zd->zones[i].conv = i < zone_nr_conv;
+		zd->zones[i].cond = zd->zones[i].conv ?
+			BLK_ZONE_COND_NOT_WP : BLK_ZONE_COND_EMPTY;
+	}
+	dev->zoned = zd;
+	dev->size = (u64)zd->nr_zones << (zd->shift + SECTOR_SHIFT);
+	set_capacity(dev->gd, dev->size >> SECTOR_SHIFT);
+
+	/*
+	 * Zoned disks take zone operations, not discards; and their
+	 * writes must reach us in order, which the scheduler sees to.
+	 */
+	blk_queue_set_zoned(dev->gd, BLK_ZONED_HM);
+	blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, q);
+	blk_queue_flag_clear(QUEUE_FLAG_DISCARD, q);
+	blk_queue_flag_clear(QUEUE_FLAG_SECERASE, q);
+	blk_queue_max_write_zeroes_sectors(q, 0);
+	blk_queue_required_elevator_features(q, ELEVATOR_F_ZBD_SEQ_WRITE);
+	blk_queue_chunk_sectors(q, zd->len);
+	blk_queue_max_zone_append_sectors(q, zd->len);
+	blk_queue_max_open_zones(q, zd->max_open);
+	blk_queue_max_active_zones(q, zd->max_active);
+
+	err = blk_revalidate_disk_zones(dev->gd, NULL);
+	if (err)
+		sbull_zoned_cleanup(dev);
+	return err;
+}
+
+void sbull_zoned_cleanup(struct sbull_dev *dev)
+{
+	if (!dev->zoned)
+		return;
+	cancel_work_sync(&dev->zoned->discard);
+	kvfree(dev->zoned->zones);
+	kfree(dev->zoned);
+	dev->zoned = NULL;
+}
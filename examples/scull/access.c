@@ -268,8 +268,10 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 
 	/* initialize the device */
 	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&lptr->device.lock);
+	if (scull_dev_init(&(lptr->device))) {
+		kfree(lptr);
+		return NULL;
+	}
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -355,9 +357,10 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	int err;
 
 	/* Initialize the device structure */
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	mutex_init(&dev->lock);
+	if (scull_dev_init(dev)) {
+		printk(KERN_NOTICE "No memory for %s\n", devinfo->name);
+		return;
+	}
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -402,13 +405,13 @@ void scull_access_cleanup(void)
 	for (i = 0; i < SCULL_N_ADEVS; i++) {
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
 		cdev_del(&dev->cdev);
-		scull_trim(dev);
+		scull_dev_cleanup(dev);
 	}
 
     	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
-		scull_trim(&(lptr->device));
+		scull_dev_cleanup(&(lptr->device));
 		kfree(lptr);
 	}
 
@@ -0,0 +1,230 @@
+/*
+ * alloc.c -- quantum allocation for the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * scullc, scullp and scullv only differ from scull in the way a
+ * quantum is allocated. Here the same four strategies are offered as
+ * backends of the bare device, selectable per device at run time, so
+ * they can be compared on the same workload.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc(), kmem_cache_*() */
+#include <linux/gfp.h>		/* alloc_pages_node() */
+#include <linux/mm.h>		/* virt_to_page(), is_vmalloc_addr() */
+#include <linux/vmalloc.h>
+#include <linux/nodemask.h>	/* next_online_node() */
+#include <linux/topology.h>	/* numa_node_id() */
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+
+#include "scull.h"		/* local definitions */
+#include "scull_trace.h"
+
+/*
+ * The plain kmalloc backend, as in the book's scull.
+ */
+static void *scull_kmalloc_alloc(struct scull_dev *dev, int node)
+{
+	return kmalloc_node(dev->quantum, GFP_KERNEL, node);
+}
+
+static void scull_kmalloc_free(struct scull_dev *dev, void *quantum)
+{
+	kfree(quantum);
+}
+
+/*
+ * A lookaside cache, as in scullc. Each device has its own cache,
+ * created for the current quantum size on first use and destroyed
+ * when the device is trimmed, as the quantum may change then.
+ */
+static atomic_t scull_cache_seq = ATOMIC_INIT(0);
+
+static void *scull_cache_alloc(struct scull_dev *dev, int node)
+{
+	struct kmem_cache *cache = READ_ONCE(dev->cache);
+	char name[24];
+
+	if (!cache) {
+		/*
+		 * The name is copied, and must be unique among caches:
+		 * dev->id isn't, as the access devices have theirs too.
+		 */
+		snprintf(name, sizeof(name), "scull_quantum%i",
+				atomic_inc_return(&scull_cache_seq));
+		cache = kmem_cache_create(name, dev->quantum,
+				0, SLAB_HWCACHE_ALIGN, NULL);
+		if (!cache)
+			return NULL;
+		/* log appenders may race here, without the mutex */
+		if (cmpxchg(&dev->cache, NULL, cache)) {
+			kmem_cache_destroy(cache);
+			cache = dev->cache;
+		}
+	}
+	return kmem_cache_alloc_node(cache, GFP_KERNEL, node);
+}
+
+static void scull_cache_free(struct scull_dev *dev, void *quantum)
+{
+	kmem_cache_free(dev->cache, quantum);
+}
+
+static void scull_cache_release(struct scull_dev *dev)
+{
+	if (dev->cache)
+		kmem_cache_destroy(dev->cache);
+	dev->cache = NULL;
+}
+
+/*
+ * Whole pages, as in scullp (and sculld, which only adds the bus
+ * registration): the quantum is rounded up to a power-of-two block.
+ */
+static void *scull_pages_alloc(struct scull_dev *dev, int node)
+{
+	struct page *page;
+
+	page = alloc_pages_node(node, GFP_KERNEL, get_order(dev->quantum));
+	return page ? page_address(page) : NULL;
+}
+
+static void scull_pages_free(struct scull_dev *dev, void *quantum)
+{
+	free_pages((unsigned long)quantum, get_order(dev->quantum));
+}
+
+/*
+ * Virtual addresses, as in scullv.
+ */
+static void *scull_vmalloc_alloc(struct scull_dev *dev, int node)
+{
+	return vmalloc_node(dev->quantum, node);
+}
+
+static void scull_vmalloc_free(struct scull_dev *dev, void *quantum)
+{
+	vfree(quantum);
+}
+
+const struct scull_allocator scull_allocators[SCULL_ALLOC_NR] = {
+	[SCULL_ALLOC_KMALLOC] = {
+		.name    = "kmalloc",
+		.alloc   = scull_kmalloc_alloc,
+		.free    = scull_kmalloc_free,
+	},
+	[SCULL_ALLOC_CACHE] = {
+		.name    = "cache",
+		.alloc   = scull_cache_alloc,
+		.free    = scull_cache_free,
+		.release = scull_cache_release,
+	},
+	[SCULL_ALLOC_PAGES] = {
+		.name    = "pages",
+		.alloc   = scull_pages_alloc,
+		.free    = scull_pages_free,
+	},
+	[SCULL_ALLOC_VMALLOC] = {
+		.name    = "vmalloc",
+		.alloc   = scull_vmalloc_alloc,
+		.free    = scull_vmalloc_free,
+	},
+};
+
+/*
+ * Choose the node for the next quantum. The appenders of a log device
+ * get here without the device mutex, and all at once: each one takes
+ * its own turn of "numa_next" with cmpxchg.
+ */
+static int scull_quantum_node(struct scull_dev *dev)
+{
+	int node, prev;
+
+	switch (READ_ONCE(dev->numa_policy)) {
+	  case SCULL_NUMA_INTERLEAVE:
+		do {
+			prev = READ_ONCE(dev->numa_next);
+			node = next_online_node(prev);
+			if (node >= MAX_NUMNODES)
+				node = first_online_node;
+		} while (cmpxchg(&dev->numa_next, prev, node) != prev);
+		return node;
+
+	  case SCULL_NUMA_FIXED:
+		return READ_ONCE(dev->numa_node);
+
+	  default:
+		return numa_node_id();
+	}
+}
+
+/*
+ * The node a quantum really landed on, as the target may be full.
+ * A vmalloc quantum may span several nodes: count its first page.
+ */
+static int scull_quantum_nid(const void *quantum)
+{
+	if (is_vmalloc_addr(quantum))
+		return page_to_nid(vmalloc_to_page(quantum));
+	return page_to_nid(virt_to_page(quantum));
+}
+
+/*
+ * Count a quantum in (delta 1) or out (delta -1) of a device, which
+ * needn't be the one that allocated it when snapshots share quanta.
+ */
+void scull_account_quantum(struct scull_dev *dev, void *quantum, int delta)
+{
+	atomic_long_add(delta, &dev->node_quanta[scull_quantum_nid(quantum)]);
+	atomic_long_add(delta, &dev->nr_quanta);
+	atomic_long_add(delta * dev->quantum, &dev->mem);
+}
+
+/*
+ * Allocate and free one quantum with the device's backend; called
+ * with the device mutex held, or by the appenders of a log device.
+ */
+void *scull_alloc_quantum(struct scull_dev *dev)
+{
+	int node = scull_quantum_node(dev);
+	void *quantum = dev->alloc->alloc(dev, node);
+
+	trace_scull_quantum_alloc(dev->cdev.dev, dev->alloc->name, node,
+			dev->quantum, quantum);
+	if (quantum) {
+		scull_account_quantum(dev, quantum, 1);
+		this_cpu_inc(dev->stats->allocs);
+	} else
+		this_cpu_inc(dev->stats->alloc_failures);
+	return quantum;
+}
+
+void scull_free_quantum(struct scull_dev *dev, void *quantum)
+{
+	scull_account_quantum(dev, quantum, -1);
+	dev->alloc->free(dev, quantum);
+}
+
+/*
+ * Called by scull_trim once all the quanta are gone.
+ */
+void scull_alloc_release(struct scull_dev *dev)
+{
+	if (dev->alloc->release)
+		dev->alloc->release(dev);
+}
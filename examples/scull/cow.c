@@ -0,0 +1,153 @@
+/*
+ * cow.c -- copy-on-write snapshots of the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * A snapshot copies the qset list of a device into another one, but
+ * not the quanta: both lists point to the same ones. Every qset item
+ * that was snapshotted has a "cow" array beside "data", which points,
+ * for each shared slot, to the reference count of its quantum; a NULL
+ * there means the quantum is private. As a quantum may end up shared
+ * by any number of devices, the count is a small object of its own,
+ * and every owner's array points to it. It takes no global lock: the
+ * owners take theirs, and the count is atomic. Whoever drops it to
+ * zero frees it, and the quantum with it.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+
+#include "scull.h"		/* local definitions */
+
+struct scull_cow_ref {
+	atomic_t refs;		/* the devices pointing to the quantum */
+};
+
+/*
+ * Make quantum "s_pos" of a list item private before writing to it;
+ * called with dev->lock held. A count of one can't go up under us:
+ * a snapshot that would share the quantum needs our lock.
+ */
+int scull_cow_break(struct scull_dev *dev, struct scull_qset *dptr, int s_pos)
+{
+	struct scull_cow_ref *ref;
+	void *old = dptr->data[s_pos], *new;
+
+	if (!dptr->cow || !dptr->cow[s_pos])
+		return 0;
+	ref = dptr->cow[s_pos];
+	if (atomic_read(&ref->refs) > 1) {
+		new = scull_alloc_quantum(dev);
+		if (!new)
+			return -ENOMEM;
+		memcpy(new, old, dev->quantum);
+		dptr->data[s_pos] = new;
+		/* the other owners may have gone meanwhile */
+		if (atomic_dec_and_test(&ref->refs)) {
+			scull_free_quantum(dev, old);
+			kfree(ref);
+		} else
+			scull_account_quantum(dev, old, -1);
+	} else
+		kfree(ref);	/* the others are gone: it's ours */
+	dptr->cow[s_pos] = NULL;
+	return 0;
+}
+
+/*
+ * Release quantum "s_pos" of a list item, for scull_trim.
+ */
+void scull_cow_free(struct scull_dev *dev, struct scull_qset *dptr, int s_pos)
+{
+	struct scull_cow_ref *ref = dptr->cow ? dptr->cow[s_pos] : NULL;
+	void *quantum = dptr->data[s_pos];
+
+	if (ref && !atomic_dec_and_test(&ref->refs)) {
+		scull_account_quantum(dev, quantum, -1);
+		return;
+	}
+	kfree(ref);
+	scull_free_quantum(dev, quantum);
+}
+
+/*
+ * Replace the contents of "dst" with a snapshot of "src"; called with
+ * both locks held. On failure "dst" is left empty.
+ */
+int scull_snapshot(struct scull_dev *src, struct scull_dev *dst)
+{
+	struct scull_qset *sptr, *dptr, **tail = &dst->data;
+	struct scull_cow_ref *ref;
+	int qset = src->qset, i;
+
+	/* a private cache can't free the quanta of another device */
+	if (src->alloc == &scull_allocators[SCULL_ALLOC_CACHE])
+		return -EINVAL;
+	if (src->log || dst->log)
+		return -EBUSY;
+
+	scull_trim(dst);
+	dst->quantum = src->quantum;
+	dst->qset = qset;
+	dst->alloc = src->alloc;
+
+	for (sptr = src->data; sptr; sptr = sptr->next) {
+		dptr = kzalloc(sizeof(*dptr), GFP_KERNEL);
+		if (!dptr)
+			goto fail;
+		*tail = dptr;
+		tail = &dptr->next;
+		atomic_long_add(sizeof(*dptr), &dst->mem);
+		if (!sptr->data)
+			continue;
+
+		if (!sptr->cow) {
+			sptr->cow = kcalloc(qset, sizeof(*sptr->cow),
+					GFP_KERNEL);
+			if (!sptr->cow)
+				goto fail;
+		}
+		dptr->cow = kcalloc(qset, sizeof(*dptr->cow), GFP_KERNEL);
+		dptr->data = kcalloc(qset, sizeof(void *), GFP_KERNEL);
+		if (!dptr->cow || !dptr->data)
+			goto fail;
+		atomic_long_add(qset * sizeof(void *), &dst->mem);
+		for (i = 0; i < qset; i++) {
+			if (!sptr->data[i])
+				continue;
+			ref = sptr->cow[i];
+			if (!ref) {
+				ref = kmalloc(sizeof(*ref), GFP_KERNEL);
+				if (!ref)
+					goto fail;
+				atomic_set(&ref->refs, 1);
+				sptr->cow[i] = ref;
+			}
+			atomic_inc(&ref->refs);
+			dptr->cow[i] = ref;
+			dptr->data[i] = sptr->data[i];
+			scull_account_quantum(dst, dptr->data[i], 1);
+		}
+	}
+	WRITE_ONCE(dst->size, src->size);
+	return 0;
+
+  fail:
+	scull_trim(dst);
+	return -ENOMEM;
+}
@@ -0,0 +1,394 @@
+/*
+ * image.c -- save and restore the bare scull devices across reloads
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * When loaded with scull_image=<path>, scull fills its devices from
+ * that file, and writes them back there when unloaded. The image is
+ * sparse: only the quanta that exist are stored, each one after its
+ * number. All the I/O goes through a large staging buffer, so the file
+ * is read and written in big sequential chunks.
+ *
+ * The image is written to <path>.tmp, which is renamed over the old
+ * one only once it is complete and synced: an unload that fails
+ * halfway, or a crash, leaves the old image as it was.
+ *
+ *   header:  "SCULLIMG", version, number of devices   (struct scull_img)
+ *   device:  id, quantum, qset, size, number of quanta (struct scull_img_dev)
+ *   quantum: its number in the device (u64), then "quantum" bytes
+ *
+ * All the fields are little-endian.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>
+#include <linux/mm.h>		/* totalram_pages */
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/namei.h>	/* lock_rename(), lookup_one_len() */
+#include <linux/mount.h>	/* mnt_want_write() */
+#include <linux/string.h>	/* kbasename() */
+#include <linux/cdev.h>
+#include <linux/err.h>
+
+#include "scull.h"		/* local definitions */
+
+#define SCULL_IMG_MAGIC   "SCULLIMG"
+#define SCULL_IMG_VERSION 1
+#define SCULL_IMG_BUFSIZE (1 << 20)	/* the staging buffer */
+
+struct scull_img {
+	char magic[8];
+	__le32 version;
+	__le32 ndevs;
+};
+
+struct scull_img_dev {
+	__le32 id;
+	__le32 quantum;
+	__le32 qset;
+	__le32 pad;
+	__le64 size;
+	__le64 nquanta;
+};
+
+/*
+ * A file with a staging buffer, used in one direction only.
+ */
+struct scull_img_file {
+	struct file *filp;
+	loff_t pos;		/* of the file */
+	char *buf;
+	size_t len, off;	/* valid bytes in buf, and where we are */
+};
+
+static int scull_img_open(struct scull_img_file *f, const char *path,
+		int flags)
+{
+	f->filp = filp_open(path, flags | O_LARGEFILE, 0600);
+	if (IS_ERR(f->filp))
+		return PTR_ERR(f->filp);
+	f->buf = vmalloc(SCULL_IMG_BUFSIZE);
+	if (!f->buf) {
+		filp_close(f->filp, NULL);
+		return -ENOMEM;
+	}
+	f->pos = 0;
+	f->len = f->off = 0;
+	return 0;
+}
+
+static void scull_img_close(struct scull_img_file *f)
+{
+	vfree(f->buf);
+	filp_close(f->filp, NULL);
+}
+
+static int scull_img_flush(struct scull_img_file *f)
+{
+	ssize_t ret;
+
+	while (f->off) {
+		ret = kernel_write(f->filp, f->buf, f->off, f->pos);
+		if (ret <= 0)
+			return ret ? ret : -EIO;
+		f->pos += ret;
+		memmove(f->buf, f->buf + ret, f->off - ret);
+		f->off -= ret;
+	}
+	return 0;
+}
+
+static int scull_img_put(struct scull_img_file *f, const void *data, size_t len)
+{
+	size_t chunk;
+	int err;
+
+	while (len) {
+		if (f->off == SCULL_IMG_BUFSIZE) {
+			err = scull_img_flush(f);
+			if (err)
+				return err;
+		}
+		chunk = min_t(size_t, len, SCULL_IMG_BUFSIZE - f->off);
+		memcpy(f->buf + f->off, data, chunk);
+		f->off += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int scull_img_fill(struct scull_img_file *f)
+{
+	int ret;
+
+	if (f->off < f->len)
+		return 0;
+	ret = kernel_read(f->filp, f->pos, f->buf, SCULL_IMG_BUFSIZE);
+	if (ret <= 0)
+		return ret ? ret : -EINVAL; /* truncated */
+	f->pos += ret;
+	f->len = ret;
+	f->off = 0;
+	return 0;
+}
+
+/* Copy the next "len" bytes to "data", or skip them if it's NULL */
+static int scull_img_get(struct scull_img_file *f, void *data, size_t len)
+{
+	size_t chunk;
+	int err;
+
+	while (len) {
+		err = scull_img_fill(f);
+		if (err)
+			return err;
+		chunk = min_t(size_t, len, f->len - f->off);
+		if (data) {
+			memcpy(data, f->buf + f->off, chunk);
+			data += chunk;
+		}
+		f->off += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static int scull_img_save_dev(struct scull_img_file *f, struct scull_dev *dev)
+{
+	struct scull_img_dev hdr;
+	struct scull_qset *dptr;
+	unsigned long nquanta = 0;
+	long item = 0;
+	__le64 index;
+	int i, err;
+
+	for (dptr = dev->data; dptr; dptr = dptr->next)
+		if (dptr->data)
+			for (i = 0; i < dev->qset; i++)
+				nquanta += dptr->data[i] != NULL;
+
+	hdr.id = cpu_to_le32(dev->id);
+	hdr.quantum = cpu_to_le32(dev->quantum);
+	hdr.qset = cpu_to_le32(dev->qset);
+	hdr.pad = 0;
+	hdr.size = cpu_to_le64(dev->size);
+	hdr.nquanta = cpu_to_le64(nquanta);
+	err = scull_img_put(f, &hdr, sizeof(hdr));
+
+	for (dptr = dev->data; dptr && !err; dptr = dptr->next, item++) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < dev->qset && !err; i++) {
+			if (!dptr->data[i])
+				continue;
+			index = cpu_to_le64((u64)item * dev->qset + i);
+			err = scull_img_put(f, &index, sizeof(index));
+			if (!err)
+				err = scull_img_put(f, dptr->data[i],
+						dev->quantum);
+		}
+	}
+	return err;
+}
+
+/*
+ * Don't trust the image: every quantum must lie within the size, and
+ * the qset list may not be longer than RAM has pages. The quanta were
+ * saved in order, so the cursor walks the list once.
+ */
+static int scull_img_restore_dev(struct scull_img_file *f,
+		struct scull_dev *dev, struct scull_img_dev *hdr)
+{
+	u64 n, nquanta = le64_to_cpu(hdr->nquanta);
+	u64 size = le64_to_cpu(hdr->size);
+	int quantum = le32_to_cpu(hdr->quantum);
+	int qset = le32_to_cpu(hdr->qset);
+	struct scull_cursor cur = { NULL, 0 };
+	unsigned long limit;	/* quanta the size can hold */
+	__le64 index;
+	char *q;
+	int err;
+
+	if (size > LONG_MAX)
+		return -EINVAL;
+	limit = DIV_ROUND_UP((unsigned long)size, quantum);
+	if (nquanta > limit || DIV_ROUND_UP(limit, qset) > totalram_pages)
+		return -EINVAL;
+	dev->quantum = quantum;
+	dev->qset = qset;
+	for (n = 0; n < nquanta; n++) {
+		err = scull_img_get(f, &index, sizeof(index));
+		if (err)
+			return err;
+		if (le64_to_cpu(index) >= limit)
+			return -EINVAL;
+		q = scull_quantum_ptr(dev, &cur, le64_to_cpu(index));
+		if (!q)
+			return -ENOMEM;
+		err = scull_img_get(f, q, quantum);
+		if (err)
+			return err;
+	}
+	dev->size = size;
+	return 0;
+}
+
+/*
+ * Fill the devices from the image; called at load time. A device that
+ * doesn't exist any more (fewer scull_nr_devs) is skipped. One that
+ * fails to load is left empty, and so are the others if the image is
+ * unreadable: the reload doesn't fail because of it, but the error is
+ * returned so that the image isn't overwritten at unload.
+ */
+int scull_image_restore(void)
+{
+	struct scull_img_file f;
+	struct scull_img hdr;
+	struct scull_img_dev dhdr;
+	struct scull_dev *dev, *found;
+	int err, i, ndevs;
+	u64 n;
+
+	if (!scull_image || !*scull_image)
+		return 0;
+	err = scull_img_open(&f, scull_image, O_RDONLY);
+	if (err == -ENOENT)
+		return 0;	/* the first load */
+	if (err)
+		goto out_err;
+
+	err = scull_img_get(&f, &hdr, sizeof(hdr));
+	if (!err && (memcmp(hdr.magic, SCULL_IMG_MAGIC, sizeof(hdr.magic)) ||
+		     le32_to_cpu(hdr.version) != SCULL_IMG_VERSION))
+		err = -EINVAL;
+	ndevs = err ? 0 : le32_to_cpu(hdr.ndevs);
+
+	for (i = 0; i < ndevs && !err; i++) {
+		err = scull_img_get(&f, &dhdr, sizeof(dhdr));
+		if (err)
+			break;
+		if (!le32_to_cpu(dhdr.quantum) || !le32_to_cpu(dhdr.qset) ||
+		    le32_to_cpu(dhdr.quantum) > INT_MAX / le32_to_cpu(dhdr.qset)) {
+			err = -EINVAL;
+			break;
+		}
+		found = NULL;
+		list_for_each_entry(dev, &scull_devices, list)
+			if (dev->id == le32_to_cpu(dhdr.id))
+				found = dev;
+		if (found) {
+			mutex_lock(&found->lock);
+			err = scull_img_restore_dev(&f, found, &dhdr);
+			if (err)
+				scull_trim(found);
+			mutex_unlock(&found->lock);
+			continue;
+		}
+		/* skip the quanta of a device we don't have */
+		for (n = 0; n < le64_to_cpu(dhdr.nquanta) && !err; n++)
+			err = scull_img_get(&f, NULL, sizeof(__le64) +
+					le32_to_cpu(dhdr.quantum));
+	}
+	scull_img_close(&f);
+	if (!err)
+		return 0;
+  out_err:
+	printk(KERN_WARNING "scull: can't restore from %s, error %i\n",
+			scull_image, err);
+	return err;
+}
+
+/*
+ * Rename the complete image, open in "filp", to the name of the image.
+ * Both are in the same directory.
+ */
+static int scull_img_replace(struct file *filp)
+{
+	struct dentry *old = filp->f_path.dentry, *dir, *new;
+	const char *name = kbasename(scull_image);
+	int err;
+
+	err = mnt_want_write(filp->f_path.mnt);
+	if (err)
+		return err;
+	dir = dget_parent(old);
+	lock_rename(dir, dir);
+	new = lookup_one_len(name, dir, strlen(name));
+	if (IS_ERR(new)) {
+		err = PTR_ERR(new);
+		goto out_unlock;
+	}
+	err = -ENOENT;	/* renamed under us */
+	if (old->d_parent == dir && !d_unhashed(old))
+		err = vfs_rename(d_inode(dir), old, d_inode(dir), new,
+				NULL, 0);
+	dput(new);
+  out_unlock:
+	unlock_rename(dir, dir);
+	dput(dir);
+	mnt_drop_write(filp->f_path.mnt);
+	return err;
+}
+
+/*
+ * Write the devices to the image; called at unload time.
+ */
+void scull_image_save(void)
+{
+	struct scull_img_file f;
+	struct scull_img hdr;
+	struct scull_dev *dev;
+	char *tmp;
+	int err;
+
+	if (!scull_image || !*scull_image)
+		return;
+	tmp = kasprintf(GFP_KERNEL, "%s.tmp", scull_image);
+	if (!tmp) {
+		err = -ENOMEM;
+		goto out_err;
+	}
+	err = scull_img_open(&f, tmp, O_WRONLY | O_CREAT | O_TRUNC);
+	kfree(tmp);
+	if (err)
+		goto out_err;
+
+	memcpy(hdr.magic, SCULL_IMG_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(SCULL_IMG_VERSION);
+	hdr.ndevs = cpu_to_le32(scull_nr_devs);
+	err = scull_img_put(&f, &hdr, sizeof(hdr));
+	list_for_each_entry(dev, &scull_devices, list) {
+		if (err)
+			break;
+		mutex_lock(&dev->lock);
+		err = scull_img_save_dev(&f, dev);
+		mutex_unlock(&dev->lock);
+	}
+	if (!err)
+		err = scull_img_flush(&f);
+	if (!err)
+		err = vfs_fsync(f.filp, 0);
+	if (!err)
+		err = scull_img_replace(f.filp);
+	scull_img_close(&f);
+	if (!err)
+		return;
+  out_err:
+	/* the old image, if any, is still there */
+	printk(KERN_WARNING "scull: can't save to %s, error %i\n",
+			scull_image, err);
+}
@@ -0,0 +1,379 @@
+/*
+ * log.c -- the append-log mode of the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * In log mode every write is an append, and appenders don't take
+ * dev->lock. Each one reserves its range by adding to "log_tail",
+ * copies its data in parallel with the others, then waits for the
+ * ranges before its own to be committed. Only then does it move the
+ * "log_committed" watermark (and dev->size) past its range. Readers
+ * never look beyond the watermark, so they only see complete records.
+ *
+ * Appenders wait on one of a few queues, picked by the start of their
+ * range, so that a commit wakes the next appender and (most of the time)
+ * no one else. One that is killed while waiting can't just leave, or
+ * the log would stop there: it blanks its range and leaves it on
+ * "log_orphans", to be committed along with the range before it.
+ *
+ * Appenders build the qset list together: list items, pointer arrays
+ * and quanta are installed with cmpxchg, and the loser of a race frees
+ * its copy. Nothing is removed but by scull_trim, which excludes
+ * readers and appenders through the per-cpu "log_sem"; taking it for
+ * reading costs next to nothing in the fast paths.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kzalloc() */
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/wait.h>
+#include <linux/sched.h>	/* fatal_signal_pending() */
+#include <linux/hash.h>
+#include <linux/percpu-rwsem.h>
+
+#include <asm/uaccess.h>	/* copy_*_user */
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * A range whose appender was killed before its turn to commit.
+ */
+struct scull_log_orphan {
+	struct list_head list;
+	unsigned long start, end;
+};
+
+/*
+ * Find, or install, a slot pointer. "slot" is one of list->next,
+ * qset->data or data[s_pos]; "new" is freed by the caller if another
+ * appender got there first.
+ */
+static void *scull_log_install(void **slot, void *new)
+{
+	void *old = cmpxchg(slot, NULL, new);
+
+	return old ? old : new;
+}
+
+/*
+ * The quantum holding byte "pos", allocated if needed. Called by
+ * appenders only, within their reserved range.
+ */
+static char *scull_log_quantum(struct scull_dev *dev, long item, int s_pos)
+{
+	struct scull_qset **pp = &dev->data, *qs, *new;
+	void **data, **newdata;
+	void *q, *newq;
+	long i;
+
+	for (i = 0; ; i++) {
+		qs = lockless_dereference(*pp);
+		if (!qs) {
+			new = kzalloc(sizeof(*new), GFP_KERNEL);
+			if (!new)
+				return NULL;
+			qs = scull_log_install((void **)pp, new);
+			if (qs != new)
+				kfree(new);
+			else
+				atomic_long_add(sizeof(*new), &dev->mem);
+		}
+		if (i == item)
+			break;
+		pp = &qs->next;
+	}
+
+	data = lockless_dereference(qs->data);
+	if (!data) {
+		newdata = kcalloc(dev->qset, sizeof(void *), GFP_KERNEL);
+		if (!newdata)
+			return NULL;
+		data = scull_log_install((void **)&qs->data, newdata);
+		if (data != newdata)
+			kfree(newdata);
+		else
+			atomic_long_add(dev->qset * sizeof(void *), &dev->mem);
+	}
+
+	q = lockless_dereference(data[s_pos]);
+	if (!q) {
+		newq = scull_alloc_quantum(dev);
+		if (!newq)
+			return NULL;
+		q = scull_log_install(&data[s_pos], newq);
+		if (q != newq)
+			scull_free_quantum(dev, newq);
+	}
+	return q;
+}
+
+/*
+ * The quantum holding byte "pos" for readers, which only go below the
+ * watermark, where everything is installed already.
+ */
+static char *scull_log_lookup(struct scull_dev *dev, long item, int s_pos)
+{
+	struct scull_qset *qs = lockless_dereference(dev->data);
+	void **data;
+
+	while (qs && item--)
+		qs = lockless_dereference(qs->next);
+	if (!qs)
+		return NULL;
+	data = lockless_dereference(qs->data);
+	return data ? lockless_dereference(data[s_pos]) : NULL;
+}
+
+/*
+ * Copy "count" bytes from user space to log position "pos"; with a
+ * NULL "buf", zero them instead. Returns what was copied, or -errno.
+ */
+static ssize_t scull_log_fill(struct scull_dev *dev, const char __user *buf,
+		size_t count, unsigned long pos)
+{
+	int quantum = dev->quantum, qset = dev->qset;
+	long itemsize = quantum * qset;
+	size_t done = 0, chunk;
+	int s_pos, q_pos;
+	long rest;
+	char *q;
+
+	while (done < count) {
+		rest = pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+		q = scull_log_quantum(dev, pos / itemsize, s_pos);
+		if (!q)
+			return done ? done : -ENOMEM;
+		chunk = min_t(size_t, count - done, quantum - q_pos);
+		if (!buf)
+			memset(q + q_pos, 0, chunk);
+		else if (copy_from_user(q + q_pos, buf + done, chunk))
+			return done ? done : -EFAULT;
+		done += chunk;
+		pos += chunk;
+	}
+	return done;
+}
+
+/*
+ * The queue where the appender of the range starting at "start" waits.
+ */
+static wait_queue_head_t *scull_log_waitq(struct scull_dev *dev,
+		unsigned long start)
+{
+	return &dev->log_wait[hash_long(start, SCULL_LOG_WAIT_BITS)];
+}
+
+/*
+ * Move the watermark past the range start-end, which is next in line,
+ * and past the orphans that were waiting for it; then wake whoever is
+ * next, and the readers.
+ */
+static void scull_log_commit(struct scull_dev *dev, unsigned long start,
+		unsigned long end)
+{
+	struct scull_log_orphan *o, *next;
+
+	spin_lock(&dev->log_lock);
+  again:
+	list_for_each_entry_safe(o, next, &dev->log_orphans, list) {
+		if (o->start == end) {
+			end = o->end;
+			list_del(&o->list);
+			kfree(o);
+			goto again;
+		}
+	}
+	smp_wmb();
+	atomic_long_set(&dev->log_committed, end);
+	WRITE_ONCE(dev->size, end);
+	spin_unlock(&dev->log_lock);
+	wake_up_all(scull_log_waitq(dev, end));
+	scull_follow_notify(dev, end - start);
+}
+
+/*
+ * Wait until the range start-end is next in line and commit it. If we
+ * are killed first, its data is blanked, and it is committed all the
+ * same: by us if we can, or else along with the range before it.
+ * Returns -EINTR in that case.
+ */
+static int scull_log_wait_commit(struct scull_dev *dev, unsigned long start,
+		unsigned long end)
+{
+	struct scull_log_orphan *o;
+
+	if (!wait_event_killable(*scull_log_waitq(dev, start),
+			atomic_long_read(&dev->log_committed) == start)) {
+		scull_log_commit(dev, start, end);
+		return 0;
+	}
+
+	scull_log_fill(dev, NULL, end - start, start);
+	o = kmalloc(sizeof(*o), GFP_KERNEL);
+	if (!o) {
+		/* no way to leave it behind: wait for our turn after all */
+		wait_event(*scull_log_waitq(dev, start),
+				atomic_long_read(&dev->log_committed) == start);
+		scull_log_commit(dev, start, end);
+		return -EINTR;
+	}
+	o->start = start;
+	o->end = end;
+	spin_lock(&dev->log_lock);
+	if (atomic_long_read(&dev->log_committed) != start) {
+		list_add(&o->list, &dev->log_orphans);
+		spin_unlock(&dev->log_lock);
+		return -EINTR;
+	}
+	spin_unlock(&dev->log_lock);	/* our turn came meanwhile */
+	kfree(o);
+	scull_log_commit(dev, start, end);
+	return -EINTR;
+}
+
+/*
+ * Both methods return 0 if the device is not (or no longer) in log
+ * mode, and the caller must take the locked path; otherwise they
+ * store the result in *retval.
+ */
+int scull_log_write(struct scull_dev *dev, const char __user *buf,
+		size_t count, loff_t *f_pos, ssize_t *retval)
+{
+	unsigned long start, end;
+	ssize_t copied;
+
+	percpu_down_read(&dev->log_sem);
+	if (!dev->log) {
+		percpu_up_read(&dev->log_sem);
+		return 0;
+	}
+	end = atomic_long_add_return(count, &dev->log_tail);
+	start = end - count;
+
+	copied = scull_log_fill(dev, buf, count, start);
+	/*
+	 * The range is ours and must be committed anyway, or the log
+	 * would stop there: blank out what we failed to copy. If even
+	 * that fails, the reader will find a hole and stop short.
+	 */
+	if (copied < (ssize_t)count)
+		scull_log_fill(dev, NULL, count - max_t(ssize_t, copied, 0),
+				start + max_t(ssize_t, copied, 0));
+
+	/* commit in reservation order; our data before the watermark */
+	if (scull_log_wait_commit(dev, start, end)) {
+		percpu_up_read(&dev->log_sem);
+		*retval = -EINTR;	/* killed: the data is gone */
+		return 1;
+	}
+	percpu_up_read(&dev->log_sem);
+
+	*f_pos = start + max_t(ssize_t, copied, 0);
+	*retval = copied;
+	return 1;
+}
+
+int scull_log_read(struct scull_dev *dev, char __user *buf, size_t count,
+		loff_t *f_pos, ssize_t *retval)
+{
+	int quantum = dev->quantum, qset = dev->qset;
+	long itemsize = quantum * qset;
+	unsigned long committed;
+	int s_pos, q_pos;
+	long rest;
+	char *q;
+
+	percpu_down_read(&dev->log_sem);
+	if (!dev->log) {
+		percpu_up_read(&dev->log_sem);
+		return 0;
+	}
+	*retval = 0;
+	committed = atomic_long_read(&dev->log_committed);
+	smp_rmb();	/* pairs with the one in scull_log_write */
+	if (*f_pos >= committed)
+		goto out;
+	if (*f_pos + count > committed)
+		count = committed - *f_pos;
+
+	rest = (long)*f_pos % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+	q = scull_log_lookup(dev, (long)*f_pos / itemsize, s_pos);
+	if (!q)
+		goto out; /* a failed append: don't fill holes */
+	count = min_t(size_t, count, quantum - q_pos);
+	if (copy_to_user(buf, q + q_pos, count)) {
+		*retval = -EFAULT;
+		goto out;
+	}
+	*f_pos += count;
+	*retval = count;
+  out:
+	percpu_up_read(&dev->log_sem);
+	return 1;
+}
+
+void scull_log_init(struct scull_dev *dev)
+{
+	int i;
+
+	spin_lock_init(&dev->log_lock);
+	INIT_LIST_HEAD(&dev->log_orphans);
+	for (i = 0; i < ARRAY_SIZE(dev->log_wait); i++)
+		init_waitqueue_head(&dev->log_wait[i]);
+}
+
+/*
+ * Switch log mode on or off; called with dev->lock held. The mode can
+ * only be entered while the device is empty, but it can be left at any
+ * time: the data stays, as a plain device.
+ */
+int scull_log_set(struct scull_dev *dev, int on)
+{
+	if (on) {
+		if (dev->log)
+			return 0;
+		if (dev->data)
+			return -EBUSY;
+		atomic_long_set(&dev->log_tail, 0);
+		atomic_long_set(&dev->log_committed, 0);
+		dev->log = 1;
+		return 0;
+	}
+	percpu_down_write(&dev->log_sem);	/* wait for the appenders */
+	dev->log = 0;
+	percpu_up_write(&dev->log_sem);
+	return 0;
+}
+
+/*
+ * scull_trim brackets its work with these when in log mode.
+ */
+void scull_log_trim_begin(struct scull_dev *dev)
+{
+	if (dev->log)
+		percpu_down_write(&dev->log_sem);
+}
+
+void scull_log_trim_end(struct scull_dev *dev)
+{
+	if (dev->log) {
+		atomic_long_set(&dev->log_tail, 0);
+		atomic_long_set(&dev->log_committed, 0);
+		percpu_up_write(&dev->log_sem);
+	}
+}
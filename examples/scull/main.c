@@ -19,12 +19,16 @@
 #include <linux/init.h>
 
 #include <linux/kernel.h>	/* printk() */
+#include <linux/sched.h>	/* fatal_signal_pending() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/nodemask.h>	/* node_online() and friends */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
+#include <linux/poll.h>
+#include <linux/timer.h>
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 
@@ -32,6 +36,9 @@
 
 #include "scull.h"		/* local definitions */
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 /*
  * Our parameters which can be set at load time.
  */
@@ -41,18 +48,98 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_numa_policy = SCULL_NUMA_POLICY;	/* default quantum placement */
+int scull_numa_node = 0;	/* node used by SCULL_NUMA_FIXED */
+int scull_alloc = SCULL_ALLOC;	/* default quantum allocation backend */
+int scull_follow_batch = SCULL_FOLLOW_BATCH;	/* bytes per follower wakeup */
+int scull_follow_delay = SCULL_FOLLOW_DELAY;	/* ms, at most, before one */
+int scull_prealloc_max = SCULL_PREALLOC_MAX;	/* MiB per prealloc call */
+char *scull_image;	/* where the contents are kept across reloads */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_numa_policy, int, S_IRUGO);
+module_param(scull_numa_node, int, S_IRUGO);
+module_param(scull_alloc, int, S_IRUGO);
+module_param(scull_follow_batch, int, S_IRUGO|S_IWUSR);
+module_param(scull_follow_delay, int, S_IRUGO|S_IWUSR);
+module_param(scull_prealloc_max, int, S_IRUGO|S_IWUSR);
+module_param(scull_image, charp, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 LIST_HEAD(scull_devices);
+static int scull_loaded;	/* init went all the way */
+static int scull_image_bad;	/* and couldn't restore the image */
+
+static const char *scull_numa_names[] = {
+	[SCULL_NUMA_LOCAL]      = "local",
+	[SCULL_NUMA_INTERLEAVE] = "interleave",
+	[SCULL_NUMA_FIXED]      = "fixed",
+};
+
+static int scull_numa_valid(int policy, int node)
+{
+	if (policy < SCULL_NUMA_LOCAL || policy > SCULL_NUMA_FIXED)
+		return 0;
+	if (policy == SCULL_NUMA_FIXED &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return 0;
+	return 1;
+}
+
+/*
+ * Initialize the fields of a bare device; the structure is expected
+ * to be zeroed. The quanta of every device are placed according to
+ * the load-time policy, until changed with SCULL_IOCSNUMA, and
+ * likewise allocated by the load-time backend.
+ */
+int scull_dev_init(struct scull_dev *dev)
+{
+	dev->quantum = scull_quantum;
+	dev->qset = scull_qset;
+	dev->numa_policy = scull_numa_policy;
+	dev->numa_node = scull_numa_node;
+	dev->numa_next = NUMA_NO_NODE;
+	dev->alloc = &scull_allocators[scull_alloc];
+	mutex_init(&dev->lock);
+	scull_log_init(dev);
+	init_waitqueue_head(&dev->follow_wait);
+	setup_timer(&dev->follow_timer, scull_follow_timer, (unsigned long)dev);
+	dev->node_quanta = kcalloc(nr_node_ids, sizeof(*dev->node_quanta),
+			GFP_KERNEL);
+	if (!dev->node_quanta)
+		return -ENOMEM;
+	if (scull_stats_alloc(dev))
+		goto fail_stats;
+	if (percpu_init_rwsem(&dev->log_sem))
+		goto fail_sem;
+	return 0;
+
+  fail_sem:
+	scull_stats_free(dev);
+  fail_stats:
+	kfree(dev->node_quanta);
+	dev->node_quanta = NULL;
+	return -ENOMEM;
+}
 
+/*
+ * Release everything scull_dev_init() and the data methods allocated.
+ */
+void scull_dev_cleanup(struct scull_dev *dev)
+{
+	del_timer_sync(&dev->follow_timer);
+	scull_trim(dev);
+	kfree(dev->node_quanta);
+	dev->node_quanta = NULL;
+	scull_stats_free(dev);
+	percpu_free_rwsem(&dev->log_sem);
+}
 
 /*
  * Empty out the scull device; must be called with the device
@@ -62,27 +149,43 @@ int scull_trim(struct scull_dev *dev)
 {
 	struct scull_qset *next, *dptr;
 	int qset = dev->qset;   /* "dev" is not-null */
+	unsigned long quanta = 0;
 	int i;
 
+	scull_log_trim_begin(dev);
 	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
+				if (dptr->data[i]) {
+					scull_cow_free(dev, dptr, i);
+					quanta++;
+				}
 			kfree(dptr->data);
 			dptr->data = NULL;
 		}
+		kfree(dptr->cow);
 		next = dptr->next;
 		kfree(dptr);
 	}
+	scull_alloc_release(dev);
+	trace_scull_trim(dev->cdev.dev, dev->size, quanta);
 	dev->size = 0;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
 	dev->data = NULL;
+	if (dev->node_quanta)
+		for (i = 0; i < nr_node_ids; i++)
+			atomic_long_set(&dev->node_quanta[i], 0);
+	atomic_long_set(&dev->nr_quanta, 0);
+	atomic_long_set(&dev->mem, 0);
+	scull_log_trim_end(dev);
 	return 0;
 }
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 /*
  * The older read_procmem function is removed and should not be used.
+ * /proc/scullseq dumps the pointers, locking each device for the whole
+ * walk: it's a debugging aid, while /proc/scullmem is for monitoring.
  */
 
 /*
@@ -118,9 +221,9 @@ static int scull_seq_show(struct seq_file *s, void *v)
 
 	if (mutex_lock_interruptible(&dev->lock))
 		return -ERESTARTSYS;
-	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
+	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li, alloc %s\n",
 			dev->id, dev->qset,
-			dev->quantum, dev->size);
+			dev->quantum, dev->size, dev->alloc->name);
 	for (d = dev->data; d; d = d->next) { /* scan the list */
 		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
 		if (d->data && !d->next) /* dump only the last item */
@@ -182,6 +285,78 @@ static void scull_remove_proc(void)
 
 #endif /* SCULL_DEBUG */
 
+/*
+ * The node distribution of the quanta is always reported, as it's
+ * what users need to co-locate their threads with the data.
+ */
+static int scull_numa_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev;
+	int nid;
+	int policy;
+
+	/* no locking: the counters are atomic, the policy a single int */
+	list_for_each_entry(dev, &scull_devices, list) {
+		policy = READ_ONCE(dev->numa_policy);
+		seq_printf(s, "scull%i: policy %s", dev->id,
+				scull_numa_names[policy]);
+		if (policy == SCULL_NUMA_FIXED)
+			seq_printf(s, " %i", READ_ONCE(dev->numa_node));
+		for_each_node(nid)
+			seq_printf(s, " N%i=%lu", nid,
+				atomic_long_read(&dev->node_quanta[nid]));
+		seq_putc(s, '\n');
+	}
+	return 0;
+}
+
+static int scull_numa_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_numa_show, NULL);
+}
+
+static struct file_operations scull_numa_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scull_numa_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * A summary of every bare device, always there. Unlike scullseq it
+ * takes no lock and walks no list, so that monitoring tools can poll
+ * it while the devices are busy; each value is read on its own, so a
+ * line may mix values from before and after a concurrent write.
+ */
+static int scull_mem_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev;
+
+	list_for_each_entry(dev, &scull_devices, list)
+		seq_printf(s, "scull%i: size %lu quanta %ld mem %ld "
+				"quantum %i qset %i alloc %s\n", dev->id,
+				READ_ONCE(dev->size),
+				atomic_long_read(&dev->nr_quanta),
+				atomic_long_read(&dev->mem),
+				READ_ONCE(dev->quantum), READ_ONCE(dev->qset),
+				READ_ONCE(dev->alloc)->name);
+	return 0;
+}
+
+static int scull_mem_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_mem_show, NULL);
+}
+
+static struct file_operations scull_mem_proc_ops = {
+	.owner   = THIS_MODULE,
+	.open    = scull_mem_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
 
 
 
@@ -216,9 +391,14 @@ int scull_release(struct inode *inode, struct file *filp)
 /*
  * Follow the list
  */
-static struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+static struct scull_qset *scull_follow_from(struct scull_dev *dev,
+		struct scull_qset *qs, long n)
 {
-	struct scull_qset *qs = dev->data;
+	long depth = n;
+	int allocated = 0;
+
+	if (!qs)
+		qs = dev->data;
 
         /* Allocate first qset explicitly if need be */
 	if (! qs) {
@@ -226,6 +406,8 @@ static struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 		if (qs == NULL)
 			return NULL;  /* Never mind */
 		memset(qs, 0, sizeof(struct scull_qset));
+		atomic_long_add(sizeof(struct scull_qset), &dev->mem);
+		allocated++;
 	}
 
 	/* Then follow the list */
@@ -235,28 +417,161 @@ static struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 			if (qs->next == NULL)
 				return NULL;  /* Never mind */
 			memset(qs->next, 0, sizeof(struct scull_qset));
+			atomic_long_add(sizeof(struct scull_qset), &dev->mem);
+			allocated++;
 		}
 		qs = qs->next;
 	}
+	trace_scull_follow(dev->cdev.dev, depth, allocated);
 	return qs;
 }
 
+static struct scull_qset *scull_follow(struct scull_dev *dev, long n)
+{
+	return scull_follow_from(dev, NULL, n);
+}
+
+/*
+ * Follow the list to "item" from where the cursor is, or from the head
+ * if that's past it; the cursor then points there.
+ */
+static struct scull_qset *scull_cursor_follow(struct scull_dev *dev,
+		struct scull_cursor *cur, long item)
+{
+	struct scull_qset *dptr;
+
+	if (cur->qs && cur->item <= item)
+		dptr = scull_follow_from(dev, cur->qs, item - cur->item);
+	else
+		dptr = scull_follow(dev, item);
+	if (dptr) {
+		cur->qs = dptr;
+		cur->item = item;
+	}
+	return dptr;
+}
+
+/*
+ * Make sure quantum "s_pos" of a list item exists and can be written,
+ * allocating the pointer array too if need be.
+ */
+static int scull_fill_slot(struct scull_dev *dev, struct scull_qset *dptr,
+		int s_pos)
+{
+	int qset = dev->qset;
+
+	if (!dptr->data) {
+		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
+		if (!dptr->data)
+			return -ENOMEM;
+		memset(dptr->data, 0, qset * sizeof(char *));
+		atomic_long_add(qset * sizeof(char *), &dev->mem);
+	}
+	if (!dptr->data[s_pos]) {
+		dptr->data[s_pos] = scull_alloc_quantum(dev);
+		if (!dptr->data[s_pos])
+			return -ENOMEM;
+		return 0;
+	}
+	return scull_cow_break(dev, dptr, s_pos);
+}
+
 /*
  * Data management: read and write
  */
 
+/*
+ * Follow mode ("tail -f"): readers at the end of data sleep until the
+ * device grows, instead of getting 0. To keep the consumers from
+ * waking up for every few bytes, writers only wake them once
+ * scull_follow_batch bytes were added, or scull_follow_delay ms after
+ * the first unannounced write, whichever comes first.
+ */
+static void scull_follow_wake(struct scull_dev *dev)
+{
+	atomic_long_set(&dev->follow_pending, 0);
+	wake_up_interruptible(&dev->follow_wait);
+}
+
+static void scull_follow_timer(unsigned long data)
+{
+	scull_follow_wake((struct scull_dev *)data);
+}
+
+/*
+ * Called after "count" bytes were added, with or without dev->lock
+ * (append-log writers don't take it).
+ */
+void scull_follow_notify(struct scull_dev *dev, size_t count)
+{
+	if (!READ_ONCE(dev->follow) || !count)
+		return;
+	if (atomic_long_add_return(count, &dev->follow_pending) >=
+	    scull_follow_batch || !scull_follow_delay) {
+		del_timer(&dev->follow_timer);
+		scull_follow_wake(dev);
+	} else if (!timer_pending(&dev->follow_timer))
+		mod_timer(&dev->follow_timer,
+			  jiffies + msecs_to_jiffies(scull_follow_delay));
+}
+
+/*
+ * A follower found no data at "pos": wait for some. Returns 1 to retry
+ * the read, else what the read returns.
+ */
+static ssize_t scull_follow_wait(struct file *filp, struct scull_dev *dev,
+		loff_t pos)
+{
+	if (pos < READ_ONCE(dev->size))
+		return 0;	/* a hole, not the end: nothing to wait for */
+	if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+	if (wait_event_interruptible(dev->follow_wait,
+			READ_ONCE(dev->size) > pos || !READ_ONCE(dev->follow)))
+		return -ERESTARTSYS;
+	return READ_ONCE(dev->follow) ? 1 : 0;	/* switched off: EOF */
+}
+
+static unsigned int scull_poll(struct file *filp, poll_table *wait)
+{
+	struct scull_dev *dev = filp->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(filp, &dev->follow_wait, wait);
+	/* outside follow mode, a read never blocks */
+	if (!READ_ONCE(dev->follow) || filp->f_pos < READ_ONCE(dev->size))
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_dev *dev = filp->private_data; 
 	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
+	int quantum, qset;
+	int itemsize; /* how many bytes in the listitem */
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = 0;
-
-	if (mutex_lock_interruptible(&dev->lock))
+	u64 start = ktime_get_ns();
+
+	trace_scull_read_enter(dev->cdev.dev, *f_pos, count);
+  again:
+	if (READ_ONCE(dev->log) &&
+	    scull_log_read(dev, buf, count, f_pos, &retval))
+		goto out_log;
+	if (scull_lock(dev)) {
+		trace_scull_read_exit(dev->cdev.dev, *f_pos, -ERESTARTSYS);
 		return -ERESTARTSYS;
+	}
+	if (dev->log) { /* switched on meanwhile */
+		mutex_unlock(&dev->lock);
+		goto again;
+	}
+	/* read them here: a follower may have slept over a trim */
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	if (*f_pos >= dev->size)
 		goto out;
 	if (*f_pos + count > dev->size)
@@ -286,6 +601,14 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 
   out:
   	mutex_unlock(&dev->lock);
+  out_log:
+	if (retval == 0 && count && READ_ONCE(dev->follow)) {
+		retval = scull_follow_wait(filp, dev, *f_pos);
+		if (retval > 0)
+			goto again;
+	}
+	scull_stats_op(dev, SCULL_STAT_READ, retval, start);
+	trace_scull_read_exit(dev->cdev.dev, *f_pos, retval);
 	return retval;
 }
 
@@ -298,9 +621,21 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
-
-	if (mutex_lock_interruptible(&dev->lock))
+	u64 start = ktime_get_ns();
+
+	trace_scull_write_enter(dev->cdev.dev, *f_pos, count);
+  again:
+	if (READ_ONCE(dev->log) &&
+	    scull_log_write(dev, buf, count, f_pos, &retval))
+		goto out_log;
+	if (scull_lock(dev)) {
+		trace_scull_write_exit(dev->cdev.dev, *f_pos, -ERESTARTSYS);
 		return -ERESTARTSYS;
+	}
+	if (dev->log) { /* switched on meanwhile */
+		mutex_unlock(&dev->lock);
+		goto again;
+	}
 
 	if (filp->f_flags & O_APPEND)
 		*f_pos = dev->size;
@@ -312,19 +647,8 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 
 	/* follow the list up to the right position */
 	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
+	if (dptr == NULL || scull_fill_slot(dev, dptr, s_pos))
 		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
 	/* write only up to the end of this quantum */
 	if (count > quantum - q_pos)
 		count = quantum - q_pos;
@@ -337,14 +661,282 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 	retval = count;
 
         /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+	if (dev->size < *f_pos) {
+		WRITE_ONCE(dev->size, *f_pos);
+		scull_follow_notify(dev, count);
+	}
 
   out:
   	mutex_unlock(&dev->lock);
+  out_log:
+	scull_stats_op(dev, SCULL_STAT_WRITE, retval, start);
+	trace_scull_write_exit(dev->cdev.dev, *f_pos, retval);
 	return retval;
 }
 
+/*
+ * Quantum number "n" of a device, allocated if missing; image.c uses
+ * it to restore the devices. Called with dev->lock held.
+ */
+char *scull_quantum_ptr(struct scull_dev *dev, struct scull_cursor *cur,
+		unsigned long n)
+{
+	struct scull_qset *dptr = scull_cursor_follow(dev, cur, n / dev->qset);
+
+	if (!dptr || scull_fill_slot(dev, dptr, n % dev->qset))
+		return NULL;
+	return dptr->data[n % dev->qset];
+}
+
+/*
+ * Batched I/O: SCULL_IOCBATCH services many {offset, length, buffer}
+ * descriptors with a single acquisition of the device lock. A cursor
+ * remembers the last list item reached, so that ascending offsets walk
+ * the qset list once overall instead of once per descriptor.
+ */
+
+static long scull_batch_one(struct scull_dev *dev, struct scull_cursor *cur,
+		struct scull_batch_op *op)
+{
+	int quantum = dev->quantum, qset = dev->qset;
+	long itemsize = quantum * qset;
+	char __user *buf = (char __user *)(unsigned long)op->buf;
+	int write = op->op == SCULL_BATCH_WRITE;
+	loff_t pos = op->offset;
+	size_t left = op->len, count;
+	long item, rest, done = 0;
+	int s_pos, q_pos, err = 0;
+	struct scull_qset *dptr;
+
+	if (pos < 0 || pos + left < pos)
+		return -EINVAL;
+	while (left) {
+		if (!write && pos >= dev->size)
+			break;
+		item = (long)pos / itemsize;
+		rest = (long)pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		dptr = scull_cursor_follow(dev, cur, item);
+		if (!dptr) {
+			err = -ENOMEM;
+			break;
+		}
+
+		count = min_t(size_t, left, quantum - q_pos);
+		if (write) {
+			err = scull_fill_slot(dev, dptr, s_pos);
+			if (err)
+				break;
+			if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
+				err = -EFAULT;
+				break;
+			}
+			if (dev->size < pos + count) {
+				WRITE_ONCE(dev->size, pos + count);
+				scull_follow_notify(dev, count);
+			}
+		} else {
+			if (!dptr->data || !dptr->data[s_pos])
+				break; /* don't fill holes, like scull_read */
+			if (pos + count > dev->size)
+				count = dev->size - pos;
+			if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+				err = -EFAULT;
+				break;
+			}
+		}
+		pos += count;
+		buf += count;
+		left -= count;
+		done += count;
+	}
+	return done ? done : err;
+}
+
+/* Descriptors are copied in and out this many at a time */
+#define SCULL_BATCH_CHUNK 64
+
+static long scull_batch(struct file *filp, struct scull_dev *dev,
+		struct scull_batch __user *ubatch)
+{
+	struct scull_batch batch;
+	struct scull_batch_op *ops;
+	struct scull_batch_op __user *uops;
+	struct scull_cursor cur = { NULL, 0 };
+	u32 i, n, done = 0;
+	long retval = 0;
+	u64 start;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.count)
+		return 0;
+	if (batch.count > SCULL_BATCH_MAX)
+		return -EINVAL;
+	uops = (struct scull_batch_op __user *)(unsigned long)batch.ops;
+	ops = kmalloc(min_t(u32, batch.count, SCULL_BATCH_CHUNK) * sizeof(*ops),
+			GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+
+	if (scull_lock(dev)) {
+		kfree(ops);
+		return -ERESTARTSYS;
+	}
+	if (dev->log) /* the appenders don't take the lock */
+		retval = -EBUSY;
+	while (!retval && done < batch.count) {
+		n = min_t(u32, batch.count - done, SCULL_BATCH_CHUNK);
+		if (copy_from_user(ops, uops + done, n * sizeof(*ops))) {
+			retval = -EFAULT;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			start = ktime_get_ns();
+			if (ops[i].op > SCULL_BATCH_WRITE)
+				ops[i].result = -EINVAL;
+			else if (!(filp->f_mode & (ops[i].op == SCULL_BATCH_WRITE ?
+						FMODE_WRITE : FMODE_READ)))
+				ops[i].result = -EBADF;
+			else
+				ops[i].result = scull_batch_one(dev, &cur, &ops[i]);
+			scull_stats_op(dev, ops[i].op == SCULL_BATCH_WRITE ?
+					SCULL_STAT_WRITE : SCULL_STAT_READ,
+					ops[i].result, start);
+		}
+		if (copy_to_user(uops + done, ops, n * sizeof(*ops))) {
+			retval = -EFAULT;
+			break;
+		}
+		done += n;
+	}
+	mutex_unlock(&dev->lock);
+	kfree(ops);
+	return retval ? retval : done;
+}
+
+/*
+ * Allocate, ahead of the writers, every quantum of a range, so that
+ * later writes there only have to copy. New quanta are zeroed, which
+ * also faults in their pages; SCULL_PREALLOC_ZERO zeroes the data
+ * already in the range too. Unless SCULL_PREALLOC_KEEP_SIZE, the
+ * device grows to the end of the range, like fallocate() on a file.
+ * A call covers scull_prealloc_max MiB at most, and can be killed.
+ */
+static int scull_prealloc(struct scull_dev *dev,
+		struct scull_prealloc __user *uarg)
+{
+	struct scull_prealloc pa;
+	struct scull_qset *dptr = NULL;
+	long item, prev = 0, itemsize;
+	int quantum, s_pos, q_pos, fresh, retval = 0;
+	loff_t pos, end;
+	size_t count;
+
+	if (copy_from_user(&pa, uarg, sizeof(pa)))
+		return -EFAULT;
+	if (pa.flags & ~(SCULL_PREALLOC_ZERO | SCULL_PREALLOC_KEEP_SIZE))
+		return -EINVAL;
+	pos = pa.offset;
+	end = pos + pa.len;
+	if (!pa.len || pos < 0 || end < pos || end > LONG_MAX)
+		return -EINVAL;
+	if (pa.len > (u64)max(READ_ONCE(scull_prealloc_max), 0) << 20)
+		return -EFBIG;
+
+	if (scull_lock(dev))
+		return -ERESTARTSYS;
+	if (dev->log) { /* the appenders don't take the lock */
+		retval = -EBUSY;
+		goto out;
+	}
+	quantum = dev->quantum;
+	itemsize = (long)quantum * dev->qset;
+	for (; pos < end; pos += count) {
+		item = (long)pos / itemsize;
+		s_pos = ((long)pos % itemsize) / quantum;
+		q_pos = ((long)pos % itemsize) % quantum;
+		count = min_t(loff_t, end - pos, quantum - q_pos);
+
+		dptr = dptr ? scull_follow_from(dev, dptr, item - prev)
+			    : scull_follow(dev, item);
+		if (!dptr) {
+			retval = -ENOMEM;
+			break;
+		}
+		prev = item;
+		fresh = !dptr->data || !dptr->data[s_pos];
+		retval = scull_fill_slot(dev, dptr, s_pos);
+		if (retval)
+			break;
+		if (fresh)
+			memset(dptr->data[s_pos], 0, quantum);
+		else if (pa.flags & SCULL_PREALLOC_ZERO)
+			memset(dptr->data[s_pos] + q_pos, 0, count);
+		if (fatal_signal_pending(current)) {
+			pos += count;
+			retval = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	/* what was allocated stays, but the size only covers success */
+	if (!(pa.flags & SCULL_PREALLOC_KEEP_SIZE) && dev->size < pos) {
+		WRITE_ONCE(dev->size, pos);
+		scull_follow_notify(dev, pos - pa.offset);
+	}
+  out:
+	mutex_unlock(&dev->lock);
+	return retval;
+}
+
+/*
+ * Snapshot "src" into bare device "id". Both locks are needed, always
+ * taken in device order so that two opposite snapshots can't deadlock.
+ */
+static int scull_snapshot_to(struct scull_dev *src, int id)
+{
+	struct scull_dev *dst = NULL, *d, *first, *second;
+	int retval, bare = 0;
+
+	/* only between bare devices: the access ones have no order */
+	list_for_each_entry(d, &scull_devices, list) {
+		if (d->id == id)
+			dst = d;
+		if (d == src)
+			bare = 1;
+	}
+	if (!dst || !bare || dst == src)
+		return -EINVAL;
+
+	first = src->id < dst->id ? src : dst;
+	second = first == src ? dst : src;
+	if (mutex_lock_interruptible(&first->lock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible_nested(&second->lock,
+			SINGLE_DEPTH_NESTING)) {
+		mutex_unlock(&first->lock);
+		return -ERESTARTSYS;
+	}
+	retval = scull_snapshot(src, dst);
+	mutex_unlock(&second->lock);
+	mutex_unlock(&first->lock);
+	return retval;
+}
+
+/*
+ * scullpipe shares the ioctl method, but its private_data is not a
+ * scull_dev: per-device commands only apply to files whose data
+ * methods are the bare scull ones.
+ */
+static struct scull_dev *scull_ioctl_dev(struct file *filp)
+{
+	if (filp->f_op->read != scull_read)
+		return NULL;
+	return filp->private_data;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -355,6 +947,8 @@ long scull_ioctl(struct file *filp,
 
 	int err = 0, tmp;
 	int retval = 0;
+	struct scull_dev *dev = scull_ioctl_dev(filp);
+	struct scull_numa numa;
     
 	/*
 	 * extract the type and number bitfields, and don't decode
@@ -473,6 +1067,143 @@ long scull_ioctl(struct file *filp,
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	  /*
+	   * Placement only affects quanta allocated from now on;
+	   * the ones already there stay where they are.
+	   */
+	  case SCULL_IOCSNUMA:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!dev)
+			return -ENOTTY;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (!scull_numa_valid(numa.policy, numa.node))
+			return -EINVAL;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		/* the appenders of a log device read these without it */
+		WRITE_ONCE(dev->numa_node, numa.node);
+		WRITE_ONCE(dev->numa_policy, numa.policy);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCGNUMA:
+		if (!dev)
+			return -ENOTTY;
+		numa.policy = dev->numa_policy;
+		numa.node = dev->numa_node;
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
+	  /*
+	   * The backend can only change while the device is empty,
+	   * as every quantum must be freed the way it was allocated.
+	   * Not in log mode: the appenders don't take the lock, so the
+	   * device may not stay empty.
+	   */
+	  case SCULL_IOCSALLOC:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!dev)
+			return -ENOTTY;
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval)
+			break;
+		if (tmp < 0 || tmp >= SCULL_ALLOC_NR)
+			return -EINVAL;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		if (dev->data || dev->log)
+			retval = -EBUSY;
+		else
+			dev->alloc = &scull_allocators[tmp];
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCGALLOC:
+		if (!dev)
+			return -ENOTTY;
+		retval = __put_user((int)(dev->alloc - scull_allocators),
+				(int __user *)arg);
+		break;
+
+
+	  case SCULL_IOCBATCH:
+		if (!dev)
+			return -ENOTTY;
+		return scull_batch(filp, dev, (struct scull_batch __user *)arg);
+
+	  case SCULL_IOCSLOG:
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval)
+			break;
+		if (mutex_lock_interruptible(&dev->lock))
+			return -ERESTARTSYS;
+		retval = scull_log_set(dev, !!tmp);
+		mutex_unlock(&dev->lock);
+		break;
+
+	  case SCULL_IOCGLOG:
+		if (!dev)
+			return -ENOTTY;
+		retval = __put_user(READ_ONCE(dev->log), (int __user *)arg);
+		break;
+
+	  /*
+	   * Switching follow mode off releases the sleeping readers,
+	   * which then see the end of data as usual.
+	   */
+	  case SCULL_IOCSFOLLOW:
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval)
+			break;
+		WRITE_ONCE(dev->follow, !!tmp);
+		if (!tmp) {
+			del_timer_sync(&dev->follow_timer);
+			scull_follow_wake(dev);
+		}
+		break;
+
+	  case SCULL_IOCGFOLLOW:
+		if (!dev)
+			return -ENOTTY;
+		retval = __put_user(READ_ONCE(dev->follow), (int __user *)arg);
+		break;
+
+	  /*
+	   * The snapshot replaces the data of another device, which this
+	   * file doesn't give access to: it takes the administrator. The
+	   * target gets our backend too, as the quanta it now shares must
+	   * be freed the way they were allocated.
+	   */
+	  case SCULL_IOCSNAPSHOT:
+		if (!dev)
+			return -ENOTTY;
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval)
+			break;
+		return scull_snapshot_to(dev, tmp);
+
+	  case SCULL_IOCPREALLOC:
+		if (!dev)
+			return -ENOTTY;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return scull_prealloc(dev, (struct scull_prealloc __user *)arg);
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -520,6 +1251,7 @@ struct file_operations scull_fops = {
 	.llseek =   scull_llseek,
 	.read =     scull_read,
 	.write =    scull_write,
+	.poll =     scull_poll,
 	.unlocked_ioctl =    scull_ioctl,
 	.open =     scull_open,
 	.release =  scull_release,
@@ -539,10 +1271,23 @@ static void scull_cleanup_module(void)
 	struct list_head *list, *temp;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* The counters files point to the devices: remove them first */
+	scull_stats_cleanup();
+
+	/*
+	 * Not on a failed load, that would overwrite a good image; nor
+	 * over one we couldn't read, which is left for the user to see.
+	 */
+	if (scull_loaded && scull_image_bad)
+		printk(KERN_WARNING "scull: not saving over %s, which failed "
+				"to restore\n", scull_image);
+	else if (scull_loaded)
+		scull_image_save();
+
 	/* Get rid of our char dev entries */
 	list_for_each_safe(list, temp, &scull_devices) {
 		struct scull_dev *scull_dev = container_of(list, struct scull_dev, list);
-		scull_trim(scull_dev);
+		scull_dev_cleanup(scull_dev);
 		cdev_del(&scull_dev->cdev);
 		kfree(scull_dev);
 	}
@@ -550,6 +1295,8 @@ static void scull_cleanup_module(void)
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 	scull_remove_proc();
 #endif
+	remove_proc_entry("scullnuma", NULL);
+	remove_proc_entry("scullmem", NULL);
 
 	/* cleanup_module is never called if registering failed */
 	unregister_chrdev_region(devno, scull_nr_devs);
@@ -600,23 +1347,39 @@ static int scull_init_module(void)
 		return result;
 	}
 
+	if (!scull_numa_valid(scull_numa_policy, scull_numa_node)) {
+		printk(KERN_WARNING "scull: bad numa policy %d/node %d, using local\n",
+				scull_numa_policy, scull_numa_node);
+		scull_numa_policy = SCULL_NUMA_LOCAL;
+	}
+	if (scull_alloc < 0 || scull_alloc >= SCULL_ALLOC_NR) {
+		printk(KERN_WARNING "scull: bad allocator %d, using kmalloc\n",
+				scull_alloc);
+		scull_alloc = SCULL_ALLOC_KMALLOC;
+	}
+
         /* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
 	 */
+	scull_stats_init();
 	for (i = 0; i < scull_nr_devs; i++) {
 		struct scull_dev *scull_dev = kzalloc(sizeof(struct scull_dev), GFP_KERNEL);
 		if (!scull_dev) {
 			result = -ENOMEM;
 			goto fail;
 		}
+		result = scull_dev_init(scull_dev);
+		if (result) {
+			kfree(scull_dev);
+			goto fail;
+		}
 		list_add_tail(&scull_dev->list, &scull_devices);
 		scull_dev->id = i;
-		scull_dev->quantum = scull_quantum;
-		scull_dev->qset = scull_qset;
-		mutex_init(&scull_dev->lock);
 		scull_setup_cdev(scull_dev, i);
+		scull_stats_add(scull_dev);
 	}
+	scull_image_bad = scull_image_restore() != 0;
 
         /* At this point call the init function for any friend device */
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
@@ -626,6 +1389,9 @@ static int scull_init_module(void)
 #ifdef SCULL_DEBUG /* only when debugging */
 	scull_create_proc();
 #endif
+	proc_create("scullnuma", 0, NULL, &scull_numa_proc_ops);
+	proc_create("scullmem", 0, NULL, &scull_mem_proc_ops);
+	scull_loaded = 1;
 
 	return 0; /* succeed */
 
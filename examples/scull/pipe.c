@@ -31,6 +31,7 @@
 #include <asm/uaccess.h>
 
 #include "scull.h"		/* local definitions */
+#include "scull_trace.h"
 
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
@@ -38,6 +39,7 @@ struct scull_pipe {
         int buffersize;                    /* used in pointer arithmetic */
         char *rp, *wp;                     /* where to read, where to write */
         int nreaders, nwriters;            /* number of openings for r/w */
+        atomic_t fill;                     /* bytes in the buffer, for /proc */
         struct fasync_struct *async_queue; /* asynchronous readers */
         struct mutex lock;                 /* mutual exclusion lock */
         struct cdev cdev;                  /* Char device structure */
@@ -79,14 +81,16 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 	}
 	dev->buffersize = scull_p_buffer;
 	dev->end = dev->buffer + dev->buffersize;
-	if (!(dev->nreaders || dev->nwriters)) /* only reset rp and wp when 1st open */
+	if (!(dev->nreaders || dev->nwriters)) { /* only reset rp and wp when 1st open */
 		dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
+		atomic_set(&dev->fill, 0);
+	}
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
-		dev->nreaders++;
+		WRITE_ONCE(dev->nreaders, dev->nreaders + 1);
 	if (filp->f_mode & FMODE_WRITE)
-		dev->nwriters++;
+		WRITE_ONCE(dev->nwriters, dev->nwriters + 1);
 	mutex_unlock(&dev->lock);
 
 	return nonseekable_open(inode, filp);
@@ -102,12 +106,12 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 	/* scull_p_fasync(-1, filp, 0); not needed, kernel will do this */
 	mutex_lock(&dev->lock);
 	if (filp->f_mode & FMODE_READ)
-		dev->nreaders--;
+		WRITE_ONCE(dev->nreaders, dev->nreaders - 1);
 	if (filp->f_mode & FMODE_WRITE)
-		dev->nwriters--;
+		WRITE_ONCE(dev->nwriters, dev->nwriters - 1);
 	if (!(dev->nreaders || dev->nwriters)) {
 		kfree(dev->buffer);
-		/* clear all fields or /proc/scullpipe might give wrong information */
+		/* clear all fields or /proc/scullpipe* might give wrong information */
 		dev->end = dev->buffer = NULL;
 		dev->buffersize = 0;
 	}
@@ -134,8 +138,11 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
+		trace_scull_pipe_sleep(dev->cdev.dev, false, 0);
 		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
+		trace_scull_pipe_wake(dev->cdev.dev, false,
+				dev->buffersize - 1 - spacefree(dev));
 		/* otherwise loop, but first reacquire the lock */
 		if (mutex_lock_interruptible(&dev->lock))
 			return -ERESTARTSYS;
@@ -172,6 +179,7 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
 	}
 
 copy_part2_fail:
+	atomic_sub(copied, &dev->fill);
 	mutex_unlock(&dev->lock);
 
 	/* finally, awake any writers and return */
@@ -192,8 +200,12 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (spacefree(dev) == 0) {
+			trace_scull_pipe_sleep(dev->cdev.dev, true, 0);
 			schedule();
+			trace_scull_pipe_wake(dev->cdev.dev, true,
+					spacefree(dev));
+		}
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
@@ -259,6 +271,7 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	}
 
 copy_part2_fail:
+	atomic_add(copied, &dev->fill);
 	mutex_unlock(&dev->lock);
 
 	/* finally, awake any reader */
@@ -351,14 +364,14 @@ static struct seq_operations scull_p_seq_ops = {
 	.show = scull_p_seq_show
 };
 
-static int scull_p_proc_open(struct inode *inode, struct file *file)
+static int scull_p_dump_open(struct inode *inode, struct file *file)
 {
 	return seq_open(file, &scull_p_seq_ops);
 }
 
-static struct file_operations scull_p_proc_ops = {
+static struct file_operations scull_p_dump_ops = {
 	.owner = THIS_MODULE,
-	.open = scull_p_proc_open,
+	.open = scull_p_dump_open,
 	.read = seq_read,
 	.llseek = seq_lseek,
 	.release = seq_release
@@ -366,6 +379,39 @@ static struct file_operations scull_p_proc_ops = {
 
 #endif
 
+/*
+ * The always-on summary in /proc/scullpipe: no pointers and no lock,
+ * so that polling it never stalls a reader or a writer.
+ */
+static int scull_p_proc_show(struct seq_file *s, void *v)
+{
+	struct scull_pipe *p;
+	int i;
+
+	seq_printf(s, "Default buffersize is %i\n", scull_p_buffer);
+	for (i = 0; i < scull_p_nr_devs; i++) {
+		p = scull_p_devices + i;
+		seq_printf(s, "scullpipe%i: buffer %i fill %i readers %i writers %i\n",
+				i, READ_ONCE(p->buffersize),
+				atomic_read(&p->fill), READ_ONCE(p->nreaders),
+				READ_ONCE(p->nwriters));
+	}
+	return 0;
+}
+
+static int scull_p_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_p_proc_show, NULL);
+}
+
+static struct file_operations scull_p_proc_ops = {
+	.owner = THIS_MODULE,
+	.open = scull_p_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
 
 
 /*
@@ -426,8 +472,9 @@ int scull_p_init(dev_t firstdev)
 		mutex_init(&scull_p_devices[i].lock);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
-#ifdef SCULL_DEBUG
 	proc_create("scullpipe", 0, NULL, &scull_p_proc_ops);
+#ifdef SCULL_DEBUG
+	proc_create("scullpipedump", 0, NULL, &scull_p_dump_ops);
 #endif
 	return scull_p_nr_devs;
 }
@@ -440,8 +487,9 @@ void scull_p_cleanup(void)
 {
 	int i;
 
-#ifdef SCULL_DEBUG
 	remove_proc_entry("scullpipe", NULL);
+#ifdef SCULL_DEBUG
+	remove_proc_entry("scullpipedump", NULL);
 #endif
 
 	if (!scull_p_devices)
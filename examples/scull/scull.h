@@ -19,6 +19,11 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/percpu.h> /* this_cpu_*() for the counters */
+#include <linux/ktime.h>  /* ktime_get_ns() */
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/percpu-rwsem.h>
 
 /*
  * Macros to help debugging
@@ -76,21 +81,161 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
+/*
+ * Follow mode: readers are woken once this many bytes were added, or
+ * this many ms after the first write they were not told about.
+ */
+#ifndef SCULL_FOLLOW_BATCH
+#define SCULL_FOLLOW_BATCH 4096
+#endif
+
+#ifndef SCULL_FOLLOW_DELAY
+#define SCULL_FOLLOW_DELAY 10
+#endif
+
+/*
+ * Where the quanta of a bare device are placed on NUMA machines.
+ */
+#define SCULL_NUMA_LOCAL      0	/* node of the writing CPU */
+#define SCULL_NUMA_INTERLEAVE 1	/* round-robin over the online nodes */
+#define SCULL_NUMA_FIXED      2	/* always the node set with the policy */
+
+#ifndef SCULL_NUMA_POLICY
+#define SCULL_NUMA_POLICY SCULL_NUMA_LOCAL
+#endif
+
+struct scull_numa {
+	int policy;               /* one of SCULL_NUMA_* */
+	int node;                 /* only used by SCULL_NUMA_FIXED */
+};
+
+/*
+ * How the quanta of a bare device are allocated (see alloc.c).
+ */
+#define SCULL_ALLOC_KMALLOC   0	/* kmalloc, as in the book */
+#define SCULL_ALLOC_CACHE     1	/* a private lookaside cache, like scullc */
+#define SCULL_ALLOC_PAGES     2	/* whole pages, like scullp */
+#define SCULL_ALLOC_VMALLOC   3	/* virtual addresses, like scullv */
+#define SCULL_ALLOC_NR        4
+
+#ifndef SCULL_ALLOC
+#define SCULL_ALLOC SCULL_ALLOC_KMALLOC
+#endif
+
+struct scull_dev;
+
+struct scull_allocator {
+	const char *name;
+	void *(*alloc)(struct scull_dev *dev, int node);
+	void (*free)(struct scull_dev *dev, void *quantum);
+	void (*release)(struct scull_dev *dev);	/* device emptied, optional */
+};
+
+/*
+ * One descriptor of SCULL_IOCBATCH; "result" is filled in with the
+ * bytes transferred (short at end of data or at a hole) or -errno.
+ * Pointers travel as 64-bit values, so 32-bit users share the layout.
+ */
+#define SCULL_BATCH_READ  0
+#define SCULL_BATCH_WRITE 1
+#define SCULL_BATCH_MAX   4096	/* descriptors per call */
+
+struct scull_batch_op {
+	__u64 offset;
+	__u64 buf;                /* user buffer */
+	__u32 len;
+	__u32 op;                 /* SCULL_BATCH_READ or _WRITE */
+	__s64 result;
+};
+
+struct scull_batch {
+	__u64 ops;                /* user array of struct scull_batch_op */
+	__u32 count;
+	__u32 pad;
+};
+
+/*
+ * The range of SCULL_IOCPREALLOC, with SCULL_PREALLOC_* flags.
+ */
+#define SCULL_PREALLOC_ZERO      1	/* zero the existing data too */
+#define SCULL_PREALLOC_KEEP_SIZE 2	/* don't grow the device */
+
+#ifndef SCULL_PREALLOC_MAX
+#define SCULL_PREALLOC_MAX 256	/* MiB, at most, per call; else -EFBIG */
+#endif
+
+struct scull_prealloc {
+	__u64 offset;
+	__u64 len;
+	__u32 flags;
+	__u32 pad;
+};
+
+/*
+ * Per-CPU counters of a bare device, shown in debugfs (see stats.c).
+ */
+#define SCULL_STAT_READ   0
+#define SCULL_STAT_WRITE  1
+#define SCULL_STAT_DIRS   2
+#define SCULL_LAT_BUCKETS 32	/* log2 of ns: the last one is >= 1s */
+#define SCULL_LOG_WAIT_BITS 4	/* appenders wait on 16 queues, by range */
+
+struct scull_stats {
+	u64 ops[SCULL_STAT_DIRS];
+	u64 bytes[SCULL_STAT_DIRS];
+	u64 lat[SCULL_STAT_DIRS][SCULL_LAT_BUCKETS];
+	u64 lock_wait_ns;         /* time spent waiting for dev->lock */
+	u64 allocs;               /* quanta allocated */
+	u64 alloc_failures;
+};
+
 /*
  * Representation of scull quantum sets.
  */
+struct scull_cow_ref;		/* see cow.c */
+
 struct scull_qset {
 	void **data;
+	struct scull_cow_ref **cow; /* counts of the slots shared by snapshots */
 	struct scull_qset *next;
 };
 
+/*
+ * Where a walk down the qset list got to, so that the next access
+ * further down needn't start again from the head.
+ */
+struct scull_cursor {
+	struct scull_qset *qs;	/* NULL: start from the head */
+	long item;
+};
+
 struct scull_dev {
 	struct scull_qset *data;  /* Pointer to first quantum set */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
+	int numa_policy;          /* quantum placement, SCULL_NUMA_* */
+	int numa_node;            /* target node for SCULL_NUMA_FIXED */
+	int numa_next;            /* last node used when interleaving */
+	atomic_long_t *node_quanta; /* quanta currently held on each node */
+	atomic_long_t nr_quanta;  /* these two are read without the lock, */
+	atomic_long_t mem;        /* by /proc/scullmem: bytes of data+index */
+	const struct scull_allocator *alloc; /* quantum allocation backend */
+	struct kmem_cache *cache; /* used by the "cache" backend only */
+	struct scull_stats __percpu *stats; /* counters, see stats.c */
 	struct mutex lock;        /* mutual exclusion locking */
+	int log;                  /* append-log mode, see log.c */
+	atomic_long_t log_tail;   /* end of the space reserved by appenders */
+	atomic_long_t log_committed; /* readers stop here */
+	spinlock_t log_lock;      /* commits vs killed appenders */
+	struct list_head log_orphans; /* ranges whose appenders were killed */
+	wait_queue_head_t log_wait[1 << SCULL_LOG_WAIT_BITS]; /* to commit */
+	struct percpu_rw_semaphore log_sem; /* appenders and readers vs trim */
+	int follow;               /* readers wait at the end of data */
+	atomic_long_t follow_pending; /* bytes added since the last wakeup */
+	wait_queue_head_t follow_wait;
+	struct timer_list follow_timer; /* the wakeup of a partial batch */
 	struct cdev cdev;	  /* Char device structure		*/
 	struct list_head list;
 	int id;
@@ -110,6 +255,16 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_numa_policy;
+extern int scull_numa_node;
+extern int scull_alloc;
+extern int scull_follow_batch;
+extern int scull_follow_delay;
+extern int scull_prealloc_max;
+extern char *scull_image;
+extern struct list_head scull_devices;
+
+extern const struct scull_allocator scull_allocators[];	/* alloc.c */
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -123,7 +278,70 @@ void    scull_p_cleanup(void);
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
 
+int     scull_dev_init(struct scull_dev *dev);
+void    scull_dev_cleanup(struct scull_dev *dev);
 int     scull_trim(struct scull_dev *dev);
+void   *scull_alloc_quantum(struct scull_dev *dev);
+void    scull_free_quantum(struct scull_dev *dev, void *quantum);
+void    scull_alloc_release(struct scull_dev *dev);
+void    scull_account_quantum(struct scull_dev *dev, void *quantum,
+                              int delta);
+
+char   *scull_quantum_ptr(struct scull_dev *dev, struct scull_cursor *cur,
+                          unsigned long n);
+int     scull_image_restore(void);
+void    scull_image_save(void);
+
+int     scull_snapshot(struct scull_dev *src, struct scull_dev *dst);
+int     scull_cow_break(struct scull_dev *dev, struct scull_qset *dptr,
+                        int s_pos);
+void    scull_cow_free(struct scull_dev *dev, struct scull_qset *dptr,
+                       int s_pos);
+
+int     scull_log_write(struct scull_dev *dev, const char __user *buf,
+                        size_t count, loff_t *f_pos, ssize_t *retval);
+int     scull_log_read(struct scull_dev *dev, char __user *buf,
+                       size_t count, loff_t *f_pos, ssize_t *retval);
+void    scull_follow_notify(struct scull_dev *dev, size_t count);
+int     scull_log_set(struct scull_dev *dev, int on);
+void    scull_log_init(struct scull_dev *dev);
+void    scull_log_trim_begin(struct scull_dev *dev);
+void    scull_log_trim_end(struct scull_dev *dev);
+
+int     scull_stats_alloc(struct scull_dev *dev);
+void    scull_stats_free(struct scull_dev *dev);
+void    scull_stats_init(void);
+void    scull_stats_add(struct scull_dev *dev);
+void    scull_stats_cleanup(void);
+
+/*
+ * Account one read or write that started at "start" (ktime_get_ns)
+ * and moved "bytes" bytes; cheap enough to be always on.
+ */
+static inline void scull_stats_op(struct scull_dev *dev, int dir,
+		ssize_t bytes, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	int bucket = min(fls64(ns), SCULL_LAT_BUCKETS - 1);
+
+	this_cpu_inc(dev->stats->ops[dir]);
+	if (bytes > 0)
+		this_cpu_add(dev->stats->bytes[dir], bytes);
+	this_cpu_inc(dev->stats->lat[dir][bucket]);
+}
+
+/*
+ * mutex_lock_interruptible on dev->lock, counting the time it waited.
+ */
+static inline int scull_lock(struct scull_dev *dev)
+{
+	u64 start = ktime_get_ns();
+
+	if (mutex_lock_interruptible(&dev->lock))
+		return -ERESTARTSYS;
+	this_cpu_add(dev->stats->lock_wait_ns, ktime_get_ns() - start);
+	return 0;
+}
 
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
@@ -172,8 +390,50 @@ long     scull_ioctl(struct file *filp,
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * NUMA placement of the quanta, per bare device.
+ */
+#define SCULL_IOCSNUMA   _IOW(SCULL_IOC_MAGIC,  15, struct scull_numa)
+#define SCULL_IOCGNUMA   _IOR(SCULL_IOC_MAGIC,  16, struct scull_numa)
+
+/*
+ * Quantum allocation backend (SCULL_ALLOC_*), per bare device.
+ */
+#define SCULL_IOCSALLOC  _IOW(SCULL_IOC_MAGIC,  17, int)
+#define SCULL_IOCGALLOC  _IOR(SCULL_IOC_MAGIC,  18, int)
+
+/*
+ * Many reads and writes at scattered offsets; returns how many
+ * descriptors were processed, each with its own result.
+ */
+#define SCULL_IOCBATCH   _IOW(SCULL_IOC_MAGIC,  19, struct scull_batch)
+
+/*
+ * Append-log mode: every write appends, without serializing writers.
+ */
+#define SCULL_IOCSLOG    _IOW(SCULL_IOC_MAGIC,  20, int)
+#define SCULL_IOCGLOG    _IOR(SCULL_IOC_MAGIC,  21, int)
+
+/*
+ * Follow mode: readers at the end of data sleep until it grows.
+ */
+#define SCULL_IOCSFOLLOW _IOW(SCULL_IOC_MAGIC,  22, int)
+#define SCULL_IOCGFOLLOW _IOR(SCULL_IOC_MAGIC,  23, int)
+
+/*
+ * Copy-on-write snapshot of this device into bare device number "arg".
+ * The target is trimmed, and takes the quantum, qset and allocation
+ * backend of this device along with its data.
+ */
+#define SCULL_IOCSNAPSHOT _IOW(SCULL_IOC_MAGIC, 24, int)
+
+/*
+ * Allocate the quanta of a range before writing it.
+ */
+#define SCULL_IOCPREALLOC _IOW(SCULL_IOC_MAGIC, 25, struct scull_prealloc)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 25
 
 #endif /* _SCULL_H_ */
@@ -0,0 +1,217 @@
+/*
+ * scull_trace.h -- tracepoints for the scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * Unlike PDEBUG, these cost a not-taken branch when nobody listens.
+ * They show up as scull:* in perf and bpftrace; devices are named by
+ * their number, as the minor tells bare, pipe and access devices apart.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(scull_io_enter,
+
+	TP_PROTO(dev_t devno, loff_t pos, size_t count),
+
+	TP_ARGS(devno, pos, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	devno)
+		__field(loff_t,	pos)
+		__field(size_t,	count)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->pos = pos;
+		__entry->count = count;
+	),
+
+	TP_printk("dev %d:%d pos %lld count %zu",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->pos, __entry->count)
+);
+
+DEFINE_EVENT(scull_io_enter, scull_read_enter,
+	TP_PROTO(dev_t devno, loff_t pos, size_t count),
+	TP_ARGS(devno, pos, count)
+);
+
+DEFINE_EVENT(scull_io_enter, scull_write_enter,
+	TP_PROTO(dev_t devno, loff_t pos, size_t count),
+	TP_ARGS(devno, pos, count)
+);
+
+DECLARE_EVENT_CLASS(scull_io_exit,
+
+	TP_PROTO(dev_t devno, loff_t pos, ssize_t ret),
+
+	TP_ARGS(devno, pos, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	devno)
+		__field(loff_t,	pos)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d:%d pos %lld ret %zd",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(scull_io_exit, scull_read_exit,
+	TP_PROTO(dev_t devno, loff_t pos, ssize_t ret),
+	TP_ARGS(devno, pos, ret)
+);
+
+DEFINE_EVENT(scull_io_exit, scull_write_exit,
+	TP_PROTO(dev_t devno, loff_t pos, ssize_t ret),
+	TP_ARGS(devno, pos, ret)
+);
+
+/* How far down the qset list an access went, and what it had to add */
+TRACE_EVENT(scull_follow,
+
+	TP_PROTO(dev_t devno, long depth, int allocated),
+
+	TP_ARGS(devno, depth, allocated),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	devno)
+		__field(long,	depth)
+		__field(int,	allocated)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->depth = depth;
+		__entry->allocated = allocated;
+	),
+
+	TP_printk("dev %d:%d depth %ld allocated %d",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->depth, __entry->allocated)
+);
+
+TRACE_EVENT(scull_quantum_alloc,
+
+	TP_PROTO(dev_t devno, const char *backend, int node, int size,
+		 const void *quantum),
+
+	TP_ARGS(devno, backend, node, size, quantum),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		devno)
+		__string(backend,	backend)
+		__field(int,		node)
+		__field(int,		size)
+		__field(const void *,	quantum)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__assign_str(backend, backend);
+		__entry->node = node;
+		__entry->size = size;
+		__entry->quantum = quantum;
+	),
+
+	TP_printk("dev %d:%d %s node %d size %d quantum %p",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__get_str(backend), __entry->node, __entry->size,
+		__entry->quantum)
+);
+
+TRACE_EVENT(scull_trim,
+
+	TP_PROTO(dev_t devno, unsigned long size, unsigned long quanta),
+
+	TP_ARGS(devno, size, quanta),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		devno)
+		__field(unsigned long,	size)
+		__field(unsigned long,	quanta)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->size = size;
+		__entry->quanta = quanta;
+	),
+
+	TP_printk("dev %d:%d size %lu quanta %lu",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->size, __entry->quanta)
+);
+
+/*
+ * A scullpipe reader waiting for data, or a writer waiting for space;
+ * "avail" is what there was when going to sleep or waking up.
+ */
+DECLARE_EVENT_CLASS(scull_pipe_wait,
+
+	TP_PROTO(dev_t devno, bool writer, size_t avail),
+
+	TP_ARGS(devno, writer, avail),
+
+	TP_STRUCT__entry(
+		__field(dev_t,	devno)
+		__field(bool,	writer)
+		__field(size_t,	avail)
+	),
+
+	TP_fast_assign(
+		__entry->devno = devno;
+		__entry->writer = writer;
+		__entry->avail = avail;
+	),
+
+	TP_printk("dev %d:%d %s avail %zu",
+		MAJOR(__entry->devno), MINOR(__entry->devno),
+		__entry->writer ? "writer" : "reader", __entry->avail)
+);
+
+DEFINE_EVENT(scull_pipe_wait, scull_pipe_sleep,
+	TP_PROTO(dev_t devno, bool writer, size_t avail),
+	TP_ARGS(devno, writer, avail)
+);
+
+DEFINE_EVENT(scull_pipe_wait, scull_pipe_wake,
+	TP_PROTO(dev_t devno, bool writer, size_t avail),
+	TP_ARGS(devno, writer, avail)
+);
+
+#endif /* _SCULL_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,144 @@
+/*
+ * stats.c -- per-device counters for the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+/*
+ * The counters are updated on the local CPU only, without locks or
+ * atomics; they are summed over all the CPUs when the debugfs file
+ * (scull/scullN) is read. The sums are not a snapshot, but every
+ * counter is monotonic, which is all that is needed for rates.
+ */
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+
+#include "scull.h"		/* local definitions */
+
+static struct dentry *scull_debugfs_dir;
+
+static const char *scull_dir_names[] = {
+	[SCULL_STAT_READ]  = "read",
+	[SCULL_STAT_WRITE] = "write",
+};
+
+int scull_stats_alloc(struct scull_dev *dev)
+{
+	dev->stats = alloc_percpu(struct scull_stats);
+	return dev->stats ? 0 : -ENOMEM;
+}
+
+void scull_stats_free(struct scull_dev *dev)
+{
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
+static void scull_stats_sum(struct scull_dev *dev, struct scull_stats *sum)
+{
+	struct scull_stats *s;
+	int cpu, dir, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(dev->stats, cpu);
+		for (dir = 0; dir < SCULL_STAT_DIRS; dir++) {
+			sum->ops[dir] += s->ops[dir];
+			sum->bytes[dir] += s->bytes[dir];
+			for (i = 0; i < SCULL_LAT_BUCKETS; i++)
+				sum->lat[dir][i] += s->lat[dir][i];
+		}
+		sum->lock_wait_ns += s->lock_wait_ns;
+		sum->allocs += s->allocs;
+		sum->alloc_failures += s->alloc_failures;
+	}
+}
+
+/*
+ * Bucket i of a histogram counts the operations that took from 2^(i-1)
+ * to 2^i - 1 nanoseconds; empty buckets are not printed.
+ */
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = s->private;
+	struct scull_stats *sum;
+	int dir, i;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	scull_stats_sum(dev, sum);
+
+	for (dir = 0; dir < SCULL_STAT_DIRS; dir++)
+		seq_printf(s, "%s_ops %llu\n%s_bytes %llu\n",
+				scull_dir_names[dir], sum->ops[dir],
+				scull_dir_names[dir], sum->bytes[dir]);
+	seq_printf(s, "lock_wait_ns %llu\n", sum->lock_wait_ns);
+	seq_printf(s, "allocs %llu\n", sum->allocs);
+	seq_printf(s, "alloc_failures %llu\n", sum->alloc_failures);
+	for (dir = 0; dir < SCULL_STAT_DIRS; dir++) {
+		seq_printf(s, "%s_latency_ns:\n", scull_dir_names[dir]);
+		for (i = 0; i < SCULL_LAT_BUCKETS; i++)
+			if (sum->lat[dir][i])
+				seq_printf(s, "  %llu %llu\n",
+						i ? 1ULL << (i - 1) : 0,
+						sum->lat[dir][i]);
+	}
+	kfree(sum);
+	return 0;
+}
+
+static int scull_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_stats_show, inode->i_private);
+}
+
+static const struct file_operations scull_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = scull_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * debugfs is optional: if it is missing, the counters are still
+ * kept, just not shown.
+ */
+void scull_stats_init(void)
+{
+	scull_debugfs_dir = debugfs_create_dir("scull", NULL);
+}
+
+void scull_stats_add(struct scull_dev *dev)
+{
+	char name[16];
+
+	if (IS_ERR_OR_NULL(scull_debugfs_dir))
+		return;
+	snprintf(name, sizeof(name), "scull%i", dev->id);
+	debugfs_create_file(name, S_IRUGO, scull_debugfs_dir, dev,
+			&scull_stats_fops);
+}
+
+void scull_stats_cleanup(void)
+{
+	debugfs_remove_recursive(scull_debugfs_dir);
+	scull_debugfs_dir = NULL;
+}
@@ -21,7 +21,11 @@
 #include <linux/init.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* alloc_pages_node() */
+#include <linux/nodemask.h>
+#include <linux/topology.h>	/* numa_node_id() */
 #include <linux/fs.h>		/* everything... */
+#include <linux/sched.h>	/* capable() */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
@@ -35,11 +39,15 @@ int scullc_major =   SCULLC_MAJOR;
 int scullc_devs =    SCULLC_DEVS;	/* number of bare scullc devices */
 int scullc_qset =    SCULLC_QSET;
 int scullc_quantum = SCULLC_QUANTUM;
+int scullc_numa_policy = SCULLC_NUMA_LOCAL;
+int scullc_numa_node = 0;
 
 module_param(scullc_major, int, 0);
 module_param(scullc_devs, int, 0);
 module_param(scullc_qset, int, 0);
 module_param(scullc_quantum, int, 0);
+module_param(scullc_numa_policy, int, 0);
+module_param(scullc_numa_node, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -117,6 +125,45 @@ int scullc_read_procmem(char *buf, char **start, off_t offset,
 
 #endif /* SCULLC_USE_PROC */
 
+/*
+ * The node distribution of the quanta is always reported, as it's
+ * what users need to co-locate their threads with the data.
+ */
+static const char *scullc_numa_names[] = {
+	[SCULLC_NUMA_LOCAL]      = "local",
+	[SCULLC_NUMA_INTERLEAVE] = "interleave",
+	[SCULLC_NUMA_FIXED]      = "fixed",
+};
+
+/* the whole file fits in the page: proc handles the offset */
+int scullc_read_numa(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+	int i, nid, len = 0;
+	int limit = PAGE_SIZE - 80; /* Don't print more than this */
+	struct scullc_dev *d;
+
+	for (i = 0; i < scullc_devs && len <= limit; i++) {
+		d = &scullc_devices[i];
+		if (down_interruptible (&d->sem))
+			return -ERESTARTSYS;
+		len += sprintf(buf+len, "scullc%i: policy %s", i,
+				scullc_numa_names[d->numa_policy]);
+		if (d->numa_policy == SCULLC_NUMA_FIXED)
+			len += sprintf(buf+len, " %i", d->numa_node);
+		for_each_node(nid) {
+			if (len > limit)
+				break;
+			len += sprintf(buf+len, " N%i=%lu", nid,
+					d->node_quanta[nid]);
+		}
+		len += sprintf(buf+len, "\n");
+		up (&d->sem);
+	}
+	*eof = 1;
+	return len;
+}
+
 /*
  * Open and close
  */
@@ -147,6 +194,43 @@ int scullc_release (struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static int scullc_numa_valid(int policy, int node)
+{
+	if (policy < SCULLC_NUMA_LOCAL || policy > SCULLC_NUMA_FIXED)
+		return 0;
+	if (policy == SCULLC_NUMA_FIXED &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return 0;
+	return 1;
+}
+
+/*
+ * Choose the node for the next quantum of "dev", according to
+ * its placement policy. Called with the device semaphore held.
+ */
+static int scullc_quantum_node(struct scullc_dev *dev)
+{
+	int node;
+
+	switch (dev->numa_policy) {
+	case SCULLC_NUMA_INTERLEAVE:
+		node = next_online_node(dev->numa_next);
+		if (node >= MAX_NUMNODES)
+			node = first_online_node;
+		dev->numa_next = node;
+		return node;
+
+	case SCULLC_NUMA_FIXED:
+		if (dev->numa_node >= 0 && dev->numa_node < nr_node_ids &&
+		    node_online(dev->numa_node))
+			return dev->numa_node;
+		return numa_node_id(); /* a bogus node: place it locally */
+
+	default:
+		return numa_node_id();
+	}
+}
+
 /*
  * Follow the list 
  */
@@ -244,9 +328,11 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Allocate a quantum using the memory cache */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
+		dptr->data[s_pos] = kmem_cache_alloc_node(scullc_cache, GFP_KERNEL,
+				scullc_quantum_node(dev));
 		if (!dptr->data[s_pos])
 			goto nomem;
+		dev->node_quanta[page_to_nid(virt_to_page(dptr->data[s_pos]))]++;
 		memset(dptr->data[s_pos], 0, scullc_quantum);
 	}
 	if (count > quantum - q_pos)
@@ -276,6 +362,8 @@ int scullc_ioctl (struct inode *inode, struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
 
+	struct scullc_dev *dev = filp->private_data;
+	struct scullc_numa numa;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -356,6 +444,34 @@ int scullc_ioctl (struct inode *inode, struct file *filp,
 		scullc_qset = arg;
 		return tmp;
 
+	/*
+	 * Placement only affects quanta allocated from now on;
+	 * the ones already there stay where they are.
+	 */
+	case SCULLC_IOCSNUMA:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (!scullc_numa_valid(numa.policy, numa.node))
+			return -EINVAL;
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		dev->numa_policy = numa.policy;
+		dev->numa_node = numa.node;
+		up (&dev->sem);
+		break;
+
+	case SCULLC_IOCGNUMA:
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		numa.policy = dev->numa_policy;
+		numa.node = dev->numa_node;
+		up (&dev->sem);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -499,6 +615,9 @@ int scullc_trim(struct scullc_dev *dev)
 	dev->qset = scullc_qset;
 	dev->quantum = scullc_quantum;
 	dev->next = NULL;
+	if (dev->node_quanta)
+		memset(dev->node_quanta, 0,
+				nr_node_ids * sizeof(*dev->node_quanta));
 	return 0;
 }
 
@@ -540,6 +659,12 @@ int scullc_init(void)
 		return result;
 
 	
+	if (!scullc_numa_valid(scullc_numa_policy, scullc_numa_node)) {
+		printk(KERN_WARNING "scullc: bad numa policy %d/node %d, using local\n",
+				scullc_numa_policy, scullc_numa_node);
+		scullc_numa_policy = SCULLC_NUMA_LOCAL;
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -553,6 +678,15 @@ int scullc_init(void)
 	for (i = 0; i < scullc_devs; i++) {
 		scullc_devices[i].quantum = scullc_quantum;
 		scullc_devices[i].qset = scullc_qset;
+		scullc_devices[i].numa_policy = scullc_numa_policy;
+		scullc_devices[i].numa_node = scullc_numa_node;
+		scullc_devices[i].numa_next = NUMA_NO_NODE;
+		scullc_devices[i].node_quanta = kcalloc(nr_node_ids,
+				sizeof(unsigned long), GFP_KERNEL);
+		if (!scullc_devices[i].node_quanta) {
+			result = -ENOMEM;
+			goto fail_numa;
+		}
 		sema_init (&scullc_devices[i].sem, 1);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
@@ -567,8 +701,15 @@ int scullc_init(void)
 #ifdef SCULLC_USE_PROC /* only when available */
 	create_proc_read_entry("scullcmem", 0, NULL, scullc_read_procmem, NULL);
 #endif
+	create_proc_read_entry("scullcnuma", 0, NULL, scullc_read_numa, NULL);
 	return 0; /* succeed */
 
+  fail_numa:
+	while (--i >= 0) {
+		cdev_del(&scullc_devices[i].cdev);
+		kfree(scullc_devices[i].node_quanta);
+	}
+	kfree(scullc_devices);
   fail_malloc:
 	unregister_chrdev_region(dev, scullc_devs);
 	return result;
@@ -583,10 +724,12 @@ void scullc_cleanup(void)
 #ifdef SCULLC_USE_PROC
 	remove_proc_entry("scullcmem", NULL);
 #endif
+	remove_proc_entry("scullcnuma", NULL);
 
 	for (i = 0; i < scullc_devs; i++) {
 		cdev_del(&scullc_devices[i].cdev);
 		scullc_trim(scullc_devices + i);
+		kfree(scullc_devices[i].node_quanta);
 	}
 	kfree(scullc_devices);
 
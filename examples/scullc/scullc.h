@@ -52,6 +52,18 @@
 #define SCULLC_QUANTUM  4000 /* use a quantum size like scull */
 #define SCULLC_QSET     500
 
+/*
+ * Where the quanta are placed on NUMA machines.
+ */
+#define SCULLC_NUMA_LOCAL      0	/* node of the writing CPU */
+#define SCULLC_NUMA_INTERLEAVE 1	/* round-robin over the online nodes */
+#define SCULLC_NUMA_FIXED      2	/* always the node set with the policy */
+
+struct scullc_numa {
+	int policy;               /* one of SCULLC_NUMA_* */
+	int node;                 /* only used by SCULLC_NUMA_FIXED */
+};
+
 struct scullc_dev {
 	void **data;
 	struct scullc_dev *next;  /* next listitem */
@@ -59,6 +71,10 @@ struct scullc_dev {
 	int quantum;              /* the current allocation size */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int numa_policy;          /* quantum placement, SCULLC_NUMA_* */
+	int numa_node;            /* target node for SCULLC_NUMA_FIXED */
+	int numa_next;            /* last node used when interleaving */
+	unsigned long *node_quanta; /* quanta on each node (first item only) */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -74,6 +90,8 @@ extern int scullc_major;     /* main.c */
 extern int scullc_devs;
 extern int scullc_order;
 extern int scullc_qset;
+extern int scullc_numa_policy;
+extern int scullc_numa_node;
 
 /*
  * Prototypes for shared functions
@@ -116,7 +134,13 @@ struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 #define SCULLC_IOCXQSET    _IOWR(SCULLC_IOC_MAGIC,11, int)
 #define SCULLC_IOCHQSET    _IO(SCULLC_IOC_MAGIC,  12)
 
-#define SCULLC_IOC_MAXNR 12
+/*
+ * NUMA placement of the quanta, per device.
+ */
+#define SCULLC_IOCSNUMA    _IOW(SCULLC_IOC_MAGIC, 13, struct scullc_numa)
+#define SCULLC_IOCGNUMA    _IOR(SCULLC_IOC_MAGIC, 14, struct scullc_numa)
+
+#define SCULLC_IOC_MAXNR 14
 
 
 
@@ -20,7 +20,11 @@
 #include <linux/init.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* alloc_pages_node() */
+#include <linux/nodemask.h>
+#include <linux/topology.h>	/* numa_node_id() */
 #include <linux/fs.h>		/* everything... */
+#include <linux/sched.h>	/* capable() */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
@@ -34,11 +38,15 @@ int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
 int sculld_qset =    SCULLD_QSET;
 int sculld_order =   SCULLD_ORDER;
+int sculld_numa_policy = SCULLD_NUMA_LOCAL;
+int sculld_numa_node = 0;
 
 module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
 module_param(sculld_qset, int, 0);
 module_param(sculld_order, int, 0);
+module_param(sculld_numa_policy, int, 0);
+module_param(sculld_numa_node, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -123,6 +131,45 @@ int sculld_read_procmem(char *buf, char **start, off_t offset,
 
 #endif /* SCULLD_USE_PROC */
 
+/*
+ * The node distribution of the quanta is always reported, as it's
+ * what users need to co-locate their threads with the data.
+ */
+static const char *sculld_numa_names[] = {
+	[SCULLD_NUMA_LOCAL]      = "local",
+	[SCULLD_NUMA_INTERLEAVE] = "interleave",
+	[SCULLD_NUMA_FIXED]      = "fixed",
+};
+
+/* the whole file fits in the page: proc handles the offset */
+int sculld_read_numa(char *buf, char **start, off_t offset,
+                   int count, int *eof, void *data)
+{
+	int i, nid, len = 0;
+	int limit = PAGE_SIZE - 80; /* Don't print more than this */
+	struct sculld_dev *d;
+
+	for (i = 0; i < sculld_devs && len <= limit; i++) {
+		d = &sculld_devices[i];
+		if (down_interruptible (&d->sem))
+			return -ERESTARTSYS;
+		len += sprintf(buf+len, "sculld%i: policy %s", i,
+				sculld_numa_names[d->numa_policy]);
+		if (d->numa_policy == SCULLD_NUMA_FIXED)
+			len += sprintf(buf+len, " %i", d->numa_node);
+		for_each_node(nid) {
+			if (len > limit)
+				break;
+			len += sprintf(buf+len, " N%i=%lu", nid,
+					d->node_quanta[nid]);
+		}
+		len += sprintf(buf+len, "\n");
+		up (&d->sem);
+	}
+	*eof = 1;
+	return len;
+}
+
 /*
  * Open and close
  */
@@ -153,6 +200,43 @@ int sculld_release (struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static int sculld_numa_valid(int policy, int node)
+{
+	if (policy < SCULLD_NUMA_LOCAL || policy > SCULLD_NUMA_FIXED)
+		return 0;
+	if (policy == SCULLD_NUMA_FIXED &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return 0;
+	return 1;
+}
+
+/*
+ * Choose the node for the next quantum of "dev", according to
+ * its placement policy. Called with the device semaphore held.
+ */
+static int sculld_quantum_node(struct sculld_dev *dev)
+{
+	int node;
+
+	switch (dev->numa_policy) {
+	case SCULLD_NUMA_INTERLEAVE:
+		node = next_online_node(dev->numa_next);
+		if (node >= MAX_NUMNODES)
+			node = first_online_node;
+		dev->numa_next = node;
+		return node;
+
+	case SCULLD_NUMA_FIXED:
+		if (dev->numa_node >= 0 && dev->numa_node < nr_node_ids &&
+		    node_online(dev->numa_node))
+			return dev->numa_node;
+		return numa_node_id(); /* a bogus node: place it locally */
+
+	default:
+		return numa_node_id();
+	}
+}
+
 /*
  * Follow the list 
  */
@@ -226,6 +310,7 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 {
 	struct sculld_dev *dev = filp->private_data;
 	struct sculld_dev *dptr;
+	struct page *page;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
@@ -250,10 +335,12 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
+		page = alloc_pages_node(sculld_quantum_node(dev), GFP_KERNEL,
+				dptr->order);
+		if (!page)
 			goto nomem;
+		dptr->data[s_pos] = page_address(page);
+		dev->node_quanta[page_to_nid(page)]++;
 		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
 	}
 	if (count > quantum - q_pos)
@@ -283,6 +370,8 @@ long sculld_ioctl (struct file *filp,
                  unsigned int cmd, unsigned long arg)
 {
 
+	struct sculld_dev *dev = filp->private_data;
+	struct sculld_numa numa;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -363,6 +452,34 @@ long sculld_ioctl (struct file *filp,
 		sculld_qset = arg;
 		return tmp;
 
+	/*
+	 * Placement only affects quanta allocated from now on;
+	 * the ones already there stay where they are.
+	 */
+	case SCULLD_IOCSNUMA:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (!sculld_numa_valid(numa.policy, numa.node))
+			return -EINVAL;
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		dev->numa_policy = numa.policy;
+		dev->numa_node = numa.node;
+		up (&dev->sem);
+		break;
+
+	case SCULLD_IOCGNUMA:
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		numa.policy = dev->numa_policy;
+		numa.node = dev->numa_node;
+		up (&dev->sem);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -514,6 +631,9 @@ int sculld_trim(struct sculld_dev *dev)
 	dev->qset = sculld_qset;
 	dev->order = sculld_order;
 	dev->next = NULL;
+	if (dev->node_quanta)
+		memset(dev->node_quanta, 0,
+				nr_node_ids * sizeof(*dev->node_quanta));
 	return 0;
 }
 
@@ -577,6 +697,12 @@ int sculld_init(void)
 	 */
 	register_ldd_driver(&sculld_driver);
 	
+	if (!sculld_numa_valid(sculld_numa_policy, sculld_numa_node)) {
+		printk(KERN_WARNING "sculld: bad numa policy %d/node %d, using local\n",
+				sculld_numa_policy, sculld_numa_node);
+		sculld_numa_policy = SCULLD_NUMA_LOCAL;
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -590,6 +716,15 @@ int sculld_init(void)
 	for (i = 0; i < sculld_devs; i++) {
 		sculld_devices[i].order = sculld_order;
 		sculld_devices[i].qset = sculld_qset;
+		sculld_devices[i].numa_policy = sculld_numa_policy;
+		sculld_devices[i].numa_node = sculld_numa_node;
+		sculld_devices[i].numa_next = NUMA_NO_NODE;
+		sculld_devices[i].node_quanta = kcalloc(nr_node_ids,
+				sizeof(unsigned long), GFP_KERNEL);
+		if (!sculld_devices[i].node_quanta) {
+			result = -ENOMEM;
+			goto fail_numa;
+		}
 		sema_init (&sculld_devices[i].sem, 1);
 		sculld_setup_cdev(sculld_devices + i, i);
 		sculld_register_dev(sculld_devices + i, i);
@@ -599,8 +734,17 @@ int sculld_init(void)
 #ifdef SCULLD_USE_PROC /* only when available */
 	create_proc_read_entry("sculldmem", 0, NULL, sculld_read_procmem, NULL);
 #endif
+	create_proc_read_entry("sculldnuma", 0, NULL, sculld_read_numa, NULL);
 	return 0; /* succeed */
 
+  fail_numa:
+	while (--i >= 0) {
+		unregister_ldd_device(&sculld_devices[i].ldev);
+		cdev_del(&sculld_devices[i].cdev);
+		kfree(sculld_devices[i].node_quanta);
+	}
+	kfree(sculld_devices);
+	unregister_ldd_driver(&sculld_driver);
   fail_malloc:
 	unregister_chrdev_region(dev, sculld_devs);
 	return result;
@@ -615,11 +759,13 @@ void sculld_cleanup(void)
 #ifdef SCULLD_USE_PROC
 	remove_proc_entry("sculldmem", NULL);
 #endif
+	remove_proc_entry("sculldnuma", NULL);
 
 	for (i = 0; i < sculld_devs; i++) {
 		unregister_ldd_device(&sculld_devices[i].ldev);
 		cdev_del(&sculld_devices[i].cdev);
 		sculld_trim(sculld_devices + i);
+		kfree(sculld_devices[i].node_quanta);
 	}
 	kfree(sculld_devices);
 	unregister_ldd_driver(&sculld_driver);
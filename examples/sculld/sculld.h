@@ -55,6 +55,18 @@
 #define SCULLD_ORDER    0 /* one page at a time */
 #define SCULLD_QSET     500
 
+/*
+ * Where the quanta are placed on NUMA machines.
+ */
+#define SCULLD_NUMA_LOCAL      0	/* node of the writing CPU */
+#define SCULLD_NUMA_INTERLEAVE 1	/* round-robin over the online nodes */
+#define SCULLD_NUMA_FIXED      2	/* always the node set with the policy */
+
+struct sculld_numa {
+	int policy;               /* one of SCULLD_NUMA_* */
+	int node;                 /* only used by SCULLD_NUMA_FIXED */
+};
+
 struct sculld_dev {
 	void **data;
 	struct sculld_dev *next;  /* next listitem */
@@ -62,6 +74,10 @@ struct sculld_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int numa_policy;          /* quantum placement, SCULLD_NUMA_* */
+	int numa_node;            /* target node for SCULLD_NUMA_FIXED */
+	int numa_next;            /* last node used when interleaving */
+	unsigned long *node_quanta; /* quanta on each node (first item only) */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 	char devname[20];
@@ -79,6 +95,8 @@ extern int sculld_major;     /* main.c */
 extern int sculld_devs;
 extern int sculld_order;
 extern int sculld_qset;
+extern int sculld_numa_policy;
+extern int sculld_numa_node;
 
 /*
  * Prototypes for shared functions
@@ -121,7 +139,13 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n);
 #define SCULLD_IOCXQSET    _IOWR(SCULLD_IOC_MAGIC,11, int)
 #define SCULLD_IOCHQSET    _IO(SCULLD_IOC_MAGIC,  12)
 
-#define SCULLD_IOC_MAXNR 12
+/*
+ * NUMA placement of the quanta, per device.
+ */
+#define SCULLD_IOCSNUMA    _IOW(SCULLD_IOC_MAGIC, 13, struct sculld_numa)
+#define SCULLD_IOCGNUMA    _IOR(SCULLD_IOC_MAGIC, 14, struct sculld_numa)
+
+#define SCULLD_IOC_MAXNR 14
 
 
 
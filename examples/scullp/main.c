@@ -15,19 +15,22 @@
  * $Id: _main.c.in,v 1.21 2004/10/14 20:11:39 corbet Exp $
  */
 
-#include <linux/config.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* alloc_pages_node() */
+#include <linux/nodemask.h>
+#include <linux/topology.h>	/* numa_node_id() */
 #include <linux/fs.h>		/* everything... */
+#include <linux/capability.h>	/* capable() */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
-#include <linux/aio.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include "scullp.h"		/* local definitions */
 
 
@@ -35,11 +38,15 @@ int scullp_major =   SCULLP_MAJOR;
 int scullp_devs =    SCULLP_DEVS;	/* number of bare scullp devices */
 int scullp_qset =    SCULLP_QSET;
 int scullp_order =   SCULLP_ORDER;
+int scullp_numa_policy = SCULLP_NUMA_LOCAL;
+int scullp_numa_node = 0;
 
 module_param(scullp_major, int, 0);
 module_param(scullp_devs, int, 0);
 module_param(scullp_qset, int, 0);
 module_param(scullp_order, int, 0);
+module_param(scullp_numa_policy, int, 0);
+module_param(scullp_numa_node, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -55,66 +62,68 @@ void scullp_cleanup(void);
 
 #ifdef SCULLP_USE_PROC /* don't waste space if unused */
 /*
- * The proc filesystem: function to read and entry
+ * The proc filesystem: a single seq_file dumping every device
  */
 
-void scullp_proc_offset(char *buf, char **start, off_t *offset, int *len)
+static int scullp_proc_show(struct seq_file *s, void *v)
 {
-	if (*offset == 0)
-		return;
-	if (*offset >= *len) {
-		/* Not there yet */
-		*offset -= *len;
-		*len = 0;
-	} else {
-		/* We're into the interesting stuff now */
-		*start = buf + *offset;
-		*offset = 0;
-	}
-}
-
-/* FIXME: Do we need this here??  It be ugly  */
-int scullp_read_procmem(char *buf, char **start, off_t offset,
-                   int count, int *eof, void *data)
-{
-	int i, j, order, qset, len = 0;
-	int limit = count - 80; /* Don't print more than this */
+	int i, j, order, qset;
 	struct scullp_dev *d;
 
-	*start = buf;
 	for(i = 0; i < scullp_devs; i++) {
 		d = &scullp_devices[i];
 		if (down_interruptible (&d->sem))
 			return -ERESTARTSYS;
 		qset = d->qset;  /* retrieve the features of each device */
 		order = d->order;
-		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
+		seq_printf(s, "\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
 		for (; d; d = d->next) { /* scan the list */
-			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
-			scullp_proc_offset (buf, start, &offset, &len);
-			if (len > limit)
-				goto out;
+			seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
 			if (d->data && !d->next) /* dump only the last item - save space */
 				for (j = 0; j < qset; j++) {
 					if (d->data[j])
-						len += sprintf(buf+len,"    % 4i:%8p\n",j,d->data[j]);
-					scullp_proc_offset (buf, start, &offset, &len);
-					if (len > limit)
-						goto out;
+						seq_printf(s, "    % 4i:%8p\n", j, d->data[j]);
 				}
 		}
-	  out:
 		up (&scullp_devices[i].sem);
-		if (len > limit)
-			break;
 	}
-	*eof = 1;
-	return len;
+	return 0;
 }
 
 #endif /* SCULLP_USE_PROC */
 
+/*
+ * The node distribution of the quanta is always reported, as it's
+ * what users need to co-locate their threads with the data.
+ */
+static const char *scullp_numa_names[] = {
+	[SCULLP_NUMA_LOCAL]      = "local",
+	[SCULLP_NUMA_INTERLEAVE] = "interleave",
+	[SCULLP_NUMA_FIXED]      = "fixed",
+};
+
+static int scullp_numa_show(struct seq_file *s, void *v)
+{
+	int i, nid;
+	struct scullp_dev *d;
+
+	for (i = 0; i < scullp_devs; i++) {
+		d = &scullp_devices[i];
+		if (down_interruptible (&d->sem))
+			return -ERESTARTSYS;
+		seq_printf(s, "scullp%i: policy %s", i,
+				scullp_numa_names[d->numa_policy]);
+		if (d->numa_policy == SCULLP_NUMA_FIXED)
+			seq_printf(s, " %i", d->numa_node);
+		for_each_node(nid)
+			seq_printf(s, " N%i=%lu", nid, d->node_quanta[nid]);
+		seq_putc(s, '\n');
+		up (&d->sem);
+	}
+	return 0;
+}
+
 /*
  * Open and close
  */
@@ -145,6 +154,43 @@ int scullp_release (struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static int scullp_numa_valid(int policy, int node)
+{
+	if (policy < SCULLP_NUMA_LOCAL || policy > SCULLP_NUMA_FIXED)
+		return 0;
+	if (policy == SCULLP_NUMA_FIXED &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return 0;
+	return 1;
+}
+
+/*
+ * Choose the node for the next quantum of "dev", according to
+ * its placement policy. Called with the device semaphore held.
+ */
+static int scullp_quantum_node(struct scullp_dev *dev)
+{
+	int node;
+
+	switch (dev->numa_policy) {
+	case SCULLP_NUMA_INTERLEAVE:
+		node = next_online_node(dev->numa_next);
+		if (node >= MAX_NUMNODES)
+			node = first_online_node;
+		dev->numa_next = node;
+		return node;
+
+	case SCULLP_NUMA_FIXED:
+		if (dev->numa_node >= 0 && dev->numa_node < nr_node_ids &&
+		    node_online(dev->numa_node))
+			return dev->numa_node;
+		return numa_node_id(); /* a bogus node: place it locally */
+
+	default:
+		return numa_node_id();
+	}
+}
+
 /*
  * Follow the list 
  */
@@ -152,8 +198,9 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
 {
 	while (n--) {
 		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullp_dev));
+			dev->next = kzalloc(sizeof(struct scullp_dev), GFP_KERNEL);
+			if (!dev->next)
+				return NULL;
 		}
 		dev = dev->next;
 		continue;
@@ -190,7 +237,7 @@ ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullp_follow(dev, item);
 
-	if (!dptr->data)
+	if (!dptr || !dptr->data)
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
@@ -218,6 +265,7 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 {
 	struct scullp_dev *dev = filp->private_data;
 	struct scullp_dev *dptr;
+	struct page *page;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
@@ -234,6 +282,8 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 
 	/* follow the list up to the right position */
 	dptr = scullp_follow(dev, item);
+	if (!dptr)
+		goto nomem;
 	if (!dptr->data) {
 		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
 		if (!dptr->data)
@@ -242,11 +292,13 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
+		page = alloc_pages_node(scullp_quantum_node(dev), GFP_KERNEL,
+				dev->order);
+		if (!page)
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+		dptr->data[s_pos] = page_address(page);
+		dev->node_quanta[page_to_nid(page)]++;
+		memset(dptr->data[s_pos], 0, quantum);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -271,10 +323,21 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
  * The ioctl() implementation
  */
 
-int scullp_ioctl (struct inode *inode, struct file *filp,
-                 unsigned int cmd, unsigned long arg)
+/*
+ * Orders the buddy allocator can serve. The huge_fault path maps
+ * quanta of HPAGE_PMD_ORDER, which is below MAX_ORDER on every
+ * architecture that has PMD-sized pages.
+ */
+static inline int scullp_order_ok(long order)
 {
+	return order >= 0 && order < MAX_ORDER;
+}
 
+long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+
+	struct scullp_dev *dev = filp->private_data;
+	struct scullp_numa numa;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -282,15 +345,12 @@ int scullp_ioctl (struct inode *inode, struct file *filp,
 	if (_IOC_NR(cmd) > SCULLP_IOC_MAXNR) return -ENOTTY;
 
 	/*
-	 * the type is a bitmask, and VERIFY_WRITE catches R/W
-	 * transfers. Note that the type is user-oriented, while
-	 * verify_area is kernel-oriented, so the concept of "read" and
-	 * "write" is reversed
+	 * access_ok() no longer takes a direction: it only checks that
+	 * the range is in user space, which is all the __get_user and
+	 * __put_user calls below need
 	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+	if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE))
+		err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
 	if (err)
 		return -EFAULT;
 
@@ -302,10 +362,16 @@ int scullp_ioctl (struct inode *inode, struct file *filp,
 		break;
 
 	case SCULLP_IOCSORDER: /* Set: arg points to the value */
-		ret = __get_user(scullp_order, (int __user *) arg);
+		ret = __get_user(tmp, (int __user *) arg);
+		if (ret == 0 && !scullp_order_ok(tmp))
+			ret = -EINVAL;
+		if (ret == 0)
+			scullp_order = tmp;
 		break;
 
 	case SCULLP_IOCTORDER: /* Tell: arg is the value */
+		if (!scullp_order_ok(arg))
+			return -EINVAL;
 		scullp_order = arg;
 		break;
 
@@ -317,13 +383,18 @@ int scullp_ioctl (struct inode *inode, struct file *filp,
 		return scullp_order;
 
 	case SCULLP_IOCXORDER: /* eXchange: use arg as pointer */
-		tmp = scullp_order;
-		ret = __get_user(scullp_order, (int __user *) arg);
+		ret = __get_user(tmp, (int __user *) arg);
+		if (ret == 0 && !scullp_order_ok(tmp))
+			ret = -EINVAL;
 		if (ret == 0)
-			ret = __put_user(tmp, (int __user *) arg);
+			ret = __put_user(scullp_order, (int __user *) arg);
+		if (ret == 0)
+			scullp_order = tmp;
 		break;
 
 	case SCULLP_IOCHORDER: /* sHift: like Tell + Query */
+		if (!scullp_order_ok(arg))
+			return -EINVAL;
 		tmp = scullp_order;
 		scullp_order = arg;
 		return tmp;
@@ -355,6 +426,34 @@ int scullp_ioctl (struct inode *inode, struct file *filp,
 		scullp_qset = arg;
 		return tmp;
 
+	/*
+	 * Placement only affects quanta allocated from now on;
+	 * the ones already there stay where they are.
+	 */
+	case SCULLP_IOCSNUMA:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (!scullp_numa_valid(numa.policy, numa.node))
+			return -EINVAL;
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		dev->numa_policy = numa.policy;
+		dev->numa_node = numa.node;
+		up (&dev->sem);
+		break;
+
+	case SCULLP_IOCGNUMA:
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		numa.policy = dev->numa_policy;
+		numa.node = dev->numa_node;
+		up (&dev->sem);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -393,69 +492,6 @@ loff_t scullp_llseek (struct file *filp, loff_t off, int whence)
 }
 
 
-/*
- * A simple asynchronous I/O implementation.
- */
-
-struct async_work {
-	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
-};
-
-/*
- * "Complete" an asynchronous operation.
- */
-static void scullp_do_deferred_op(void *p)
-{
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
-}
-
-
-static int scullp_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
-{
-	struct async_work *stuff;
-	int result;
-
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullp_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = scullp_read(iocb->ki_filp, buf, count, &pos);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, scullp_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
-}
-
-
-static ssize_t scullp_aio_read(struct kiocb *iocb, char __user *buf, size_t count,
-		loff_t pos)
-{
-	return scullp_defer_op(0, iocb, buf, count, pos);
-}
-
-static ssize_t scullp_aio_write(struct kiocb *iocb, const char __user *buf,
-		size_t count, loff_t pos)
-{
-	return scullp_defer_op(1, iocb, (char __user *) buf, count, pos);
-}
-
-
- 
 /*
  * Mmap *is* available, but confined in a different file
  */
@@ -471,18 +507,17 @@ struct file_operations scullp_fops = {
 	.llseek =    scullp_llseek,
 	.read =	     scullp_read,
 	.write =     scullp_write,
-	.ioctl =     scullp_ioctl,
+	.unlocked_ioctl = scullp_ioctl,
 	.mmap =	     scullp_mmap,
 	.open =	     scullp_open,
 	.release =   scullp_release,
-	.aio_read =  scullp_aio_read,
-	.aio_write = scullp_aio_write,
 };
 
 int scullp_trim(struct scullp_dev *dev)
 {
 	struct scullp_dev *next, *dptr;
 	int qset = dev->qset;   /* "dev" is not-null */
+	int order = dev->order; /* only the first item knows it */
 	int i;
 
 	if (dev->vmas) /* don't trim: there are active mappings */
@@ -494,7 +529,7 @@ int scullp_trim(struct scullp_dev *dev)
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
 					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+							order);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -506,6 +541,10 @@ int scullp_trim(struct scullp_dev *dev)
 	dev->qset = scullp_qset;
 	dev->order = scullp_order;
 	dev->next = NULL;
+	dev->fault_qs = NULL;
+	if (dev->node_quanta)
+		memset(dev->node_quanta, 0,
+				nr_node_ids * sizeof(*dev->node_quanta));
 	return 0;
 }
 
@@ -546,7 +585,18 @@ int scullp_init(void)
 	if (result < 0)
 		return result;
 
+	if (!scullp_order_ok(scullp_order)) {
+		printk(KERN_WARNING "scullp: bad order %d, using %d\n",
+				scullp_order, SCULLP_ORDER);
+		scullp_order = SCULLP_ORDER;
+	}
 	
+	if (!scullp_numa_valid(scullp_numa_policy, scullp_numa_node)) {
+		printk(KERN_WARNING "scullp: bad numa policy %d/node %d, using local\n",
+				scullp_numa_policy, scullp_numa_node);
+		scullp_numa_policy = SCULLP_NUMA_LOCAL;
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -560,16 +610,32 @@ int scullp_init(void)
 	for (i = 0; i < scullp_devs; i++) {
 		scullp_devices[i].order = scullp_order;
 		scullp_devices[i].qset = scullp_qset;
+		scullp_devices[i].numa_policy = scullp_numa_policy;
+		scullp_devices[i].numa_node = scullp_numa_node;
+		scullp_devices[i].numa_next = NUMA_NO_NODE;
+		scullp_devices[i].node_quanta = kcalloc(nr_node_ids,
+				sizeof(unsigned long), GFP_KERNEL);
+		if (!scullp_devices[i].node_quanta) {
+			result = -ENOMEM;
+			goto fail_numa;
+		}
 		sema_init (&scullp_devices[i].sem, 1);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
 
 
 #ifdef SCULLP_USE_PROC /* only when available */
-	create_proc_read_entry("scullpmem", 0, NULL, scullp_read_procmem, NULL);
+	proc_create_single("scullpmem", 0, NULL, scullp_proc_show);
 #endif
+	proc_create_single("scullpnuma", 0, NULL, scullp_numa_show);
 	return 0; /* succeed */
 
+  fail_numa:
+	while (--i >= 0) {
+		cdev_del(&scullp_devices[i].cdev);
+		kfree(scullp_devices[i].node_quanta);
+	}
+	kfree(scullp_devices);
   fail_malloc:
 	unregister_chrdev_region(dev, scullp_devs);
 	return result;
@@ -584,10 +650,12 @@ void scullp_cleanup(void)
 #ifdef SCULLP_USE_PROC
 	remove_proc_entry("scullpmem", NULL);
 #endif
+	remove_proc_entry("scullpnuma", NULL);
 
 	for (i = 0; i < scullp_devs; i++) {
 		cdev_del(&scullp_devices[i].cdev);
 		scullp_trim(scullp_devices + i);
+		kfree(scullp_devices[i].node_quanta);
 	}
 	kfree(scullp_devices);
 	unregister_chrdev_region(MKDEV (scullp_major, 0), scullp_devs);
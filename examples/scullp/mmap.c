@@ -15,15 +15,26 @@
  * $Id: _mmap.c.in,v 1.13 2004/10/18 18:07:36 corbet Exp $
  */
 
-#include <linux/config.h>
 #include <linux/module.h>
-
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
 #include <linux/mm.h>		/* everything */
+#include <linux/log2.h>	/* rounddown_pow_of_two() */
+#include <linux/huge_mm.h>	/* HPAGE_PMD_ORDER */
+#include <linux/pfn_t.h>
 #include <linux/errno.h>	/* error codes */
 #include <asm/pgtable.h>
 
 #include "scullp.h"		/* local definitions */
 
+/*
+ * How many pages are mapped by a single fault. A sequential scan then
+ * faults once every scullp_fault_around pages instead of once per page.
+ * It is rounded down to a power of two; 1 disables fault-around.
+ */
+static int scullp_fault_around = 16;
+module_param(scullp_fault_around, int, 0);
+
 
 /*
  * open and close: just keep track of how many times the device is
@@ -45,74 +56,179 @@ void scullp_vma_close(struct vm_area_struct *vma)
 }
 
 /*
- * The nopage method: the core of the file. It retrieves the
- * page required from the scullp device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
- *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * Find the list item holding quantum-set "item" without allocating
+ * anything, unlike scullp_follow. The fault path keeps a cursor in the
+ * device, so that a sequential scan doesn't walk the list from the
+ * head for every fault. Called with the device semaphore held.
  */
+static struct scullp_dev *scullp_fault_item(struct scullp_dev *dev,
+		unsigned long item)
+{
+	struct scullp_dev *ptr = dev;
+	unsigned long i = 0;
 
-struct page *scullp_vma_nopage(struct vm_area_struct *vma,
-                                unsigned long address, int *type)
+	if (dev->fault_qs && dev->fault_item <= item) {
+		ptr = dev->fault_qs;
+		i = dev->fault_item;
+	}
+	for (; ptr && i < item; i++)
+		ptr = ptr->next;
+	if (ptr) {
+		dev->fault_qs = ptr;
+		dev->fault_item = i;
+	}
+	return ptr;
+}
+
+/*
+ * Return the page at page offset "pgoff" of the device, or NULL if
+ * it falls in a hole or past the end of data. A quantum is made of
+ * 1 << order contiguous pages.
+ */
+static struct page *scullp_fault_page(struct scullp_dev *dev,
+		unsigned long pgoff)
 {
-	unsigned long offset;
-	struct scullp_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NOPAGE_SIGBUS;
-	void *pageptr = NULL; /* default to "missing" */
+	struct scullp_dev *ptr;
+	unsigned long quantum = pgoff >> dev->order;
+	void *pageptr = NULL;
+
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		return NULL; /* out of range */
+	ptr = scullp_fault_item(dev, quantum / dev->qset);
+	if (ptr && ptr->data)
+		pageptr = ptr->data[quantum % dev->qset];
+	if (!pageptr)
+		return NULL;
+	return virt_to_page(pageptr) + (pgoff & ((1UL << dev->order) - 1));
+}
 
-	down(&dev->sem);
-	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
+/*
+ * The fault method: the core of the file. It retrieves the page
+ * required from the scullp device and inserts its pfn in the process
+ * page tables, together with the pages around it that are already
+ * there, so that the following accesses don't fault at all.
+ *
+ * The mapping is a pfn one, so the page counts are not touched and
+ * any "order" can be mapped: the pages stay around because
+ * scullp_trim refuses to run while the device is mapped.
+ */
+static vm_fault_t scullp_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scullp_dev *dev = vma->vm_private_data;
+	unsigned long address = vmf->address & PAGE_MASK;
+	unsigned long window, start, end, pgoff;
+	struct page *page;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
 
+	down(&dev->sem);
 	/*
-	 * Now retrieve the scullp device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
 	 * accessing the hole.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	page = scullp_fault_page(dev, vmf->pgoff);
+	if (!page)
+		goto out;
+	ret = vmf_insert_pfn(vma, address, page_to_pfn(page));
+	if (ret != VM_FAULT_NOPAGE)
+		goto out;
+
+	/*
+	 * Now the neighbours, in an aligned window like the kernel does
+	 * for page-cache files. Holes and already-present pages are
+	 * simply skipped: they'll fault on their own if ever touched.
+	 */
+	if (scullp_fault_around <= 1)
+		goto out;
+	window = rounddown_pow_of_two(scullp_fault_around) << PAGE_SHIFT;
+	start = max(address & ~(window - 1), vma->vm_start);
+	end = min(start + window, vma->vm_end);
+	for (; start < end; start += PAGE_SIZE) {
+		if (start == address)
+			continue;
+		pgoff = vma->vm_pgoff + ((start - vma->vm_start) >> PAGE_SHIFT);
+		page = scullp_fault_page(dev, pgoff);
+		if (page && vmf_insert_pfn(vma, start, page_to_pfn(page))
+				== VM_FAULT_OOM)
+			break;
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-	if (type)
-		*type = VM_FAULT_MINOR;
   out:
 	up(&dev->sem);
-	return page;
+	return ret;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Quanta of HPAGE_PMD_ORDER or more are physically aligned to their
+ * size, as the buddy allocator hands them out, so they can be mapped
+ * with a single PMD entry wherever the virtual address and the file
+ * offset agree on the alignment. Everything else falls back to "fault".
+ */
+static vm_fault_t scullp_vma_huge_fault(struct vm_fault *vmf,
+		enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scullp_dev *dev = vma->vm_private_data;
+	unsigned long haddr = vmf->address & PMD_MASK;
+	unsigned long pgoff;
+	struct page *page;
+	vm_fault_t ret = VM_FAULT_FALLBACK;
+
+	if (pe_size != PE_SIZE_PMD)
+		return VM_FAULT_FALLBACK;
+	if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	pgoff = vma->vm_pgoff + ((haddr - vma->vm_start) >> PAGE_SHIFT);
+	if (!IS_ALIGNED(pgoff, HPAGE_PMD_NR))
+		return VM_FAULT_FALLBACK;
+
+	down(&dev->sem);
+	if (dev->order < HPAGE_PMD_ORDER)
+		goto out;
+	/* the tail of the last quantum is mapped (and SIGBUSed) by pages */
+	if (((pgoff + HPAGE_PMD_NR) << PAGE_SHIFT) > dev->size)
+		goto out;
+	page = scullp_fault_page(dev, pgoff);
+	if (page)
+		ret = vmf_insert_pfn_pmd(vmf, page_to_pfn_t(page),
+				vmf->flags & FAULT_FLAG_WRITE);
+  out:
+	up(&dev->sem);
+	return ret;
 }
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
 
 
 struct vm_operations_struct scullp_vm_ops = {
-	.open =     scullp_vma_open,
-	.close =    scullp_vma_close,
-	.nopage =   scullp_vma_nopage,
+	.open =       scullp_vma_open,
+	.close =      scullp_vma_close,
+	.fault =      scullp_vma_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.huge_fault = scullp_vma_huge_fault,
+#endif
 };
 
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_dentry->d_inode;
+	struct scullp_dev *dev = filp->private_data;
 
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
+	/*
+	 * There are no pages to copy-on-write a pfn mapping from:
+	 * refuse private mappings that could be written to.
+	 */
+	if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE)
+		return -EINVAL;
 
-	/* don't do anything here: "nopage" will set up page table entries */
+	/* don't do anything here: "fault" will set up page table entries */
 	vma->vm_ops = &scullp_vm_ops;
-	vma->vm_flags |= VM_RESERVED;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (dev->order >= HPAGE_PMD_ORDER)
+		vma->vm_flags |= VM_HUGEPAGE; /* ask for "huge_fault" */
+#endif
+	vma->vm_private_data = dev;
 	scullp_vma_open(vma);
 	return 0;
 }
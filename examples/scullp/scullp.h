@@ -15,6 +15,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/semaphore.h>
 
 /*
  * Macros to help debugging
@@ -52,6 +53,18 @@
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
+/*
+ * Where the quanta are placed on NUMA machines.
+ */
+#define SCULLP_NUMA_LOCAL      0	/* node of the writing CPU */
+#define SCULLP_NUMA_INTERLEAVE 1	/* round-robin over the online nodes */
+#define SCULLP_NUMA_FIXED      2	/* always the node set with the policy */
+
+struct scullp_numa {
+	int policy;               /* one of SCULLP_NUMA_* */
+	int node;                 /* only used by SCULLP_NUMA_FIXED */
+};
+
 struct scullp_dev {
 	void **data;
 	struct scullp_dev *next;  /* next listitem */
@@ -59,6 +72,12 @@ struct scullp_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int numa_policy;          /* quantum placement, SCULLP_NUMA_* */
+	int numa_node;            /* target node for SCULLP_NUMA_FIXED */
+	int numa_next;            /* last node used when interleaving */
+	unsigned long *node_quanta; /* quanta on each node (first item only) */
+	struct scullp_dev *fault_qs; /* fault-path cursor (first item only) */
+	unsigned long fault_item; /* list position of fault_qs */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -74,6 +93,8 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_numa_policy;
+extern int scullp_numa_node;
 
 /*
  * Prototypes for shared functions
@@ -116,7 +137,13 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 #define SCULLP_IOCXQSET    _IOWR(SCULLP_IOC_MAGIC,11, int)
 #define SCULLP_IOCHQSET    _IO(SCULLP_IOC_MAGIC,  12)
 
-#define SCULLP_IOC_MAXNR 12
+/*
+ * NUMA placement of the quanta, per device.
+ */
+#define SCULLP_IOCSNUMA    _IOW(SCULLP_IOC_MAGIC, 13, struct scullp_numa)
+#define SCULLP_IOCGNUMA    _IOR(SCULLP_IOC_MAGIC, 14, struct scullp_numa)
+
+#define SCULLP_IOC_MAXNR 14
 
 
 
@@ -15,19 +15,22 @@
  * $Id: _main.c.in,v 1.21 2004/10/14 20:11:39 corbet Exp $
  */
 
-#include <linux/config.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* alloc_pages_node() */
+#include <linux/nodemask.h>
+#include <linux/topology.h>	/* numa_node_id() */
 #include <linux/fs.h>		/* everything... */
+#include <linux/capability.h>	/* capable() */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
-#include <linux/aio.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <linux/vmalloc.h>
 #include "scullv.h"		/* local definitions */
 
@@ -36,11 +39,15 @@ int scullv_major =   SCULLV_MAJOR;
 int scullv_devs =    SCULLV_DEVS;	/* number of bare scullv devices */
 int scullv_qset =    SCULLV_QSET;
 int scullv_order =   SCULLV_ORDER;
+int scullv_numa_policy = SCULLV_NUMA_LOCAL;
+int scullv_numa_node = 0;
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_numa_policy, int, 0);
+module_param(scullv_numa_node, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -56,66 +63,68 @@ void scullv_cleanup(void);
 
 #ifdef SCULLV_USE_PROC /* don't waste space if unused */
 /*
- * The proc filesystem: function to read and entry
+ * The proc filesystem: a single seq_file dumping every device
  */
 
-void scullv_proc_offset(char *buf, char **start, off_t *offset, int *len)
+static int scullv_proc_show(struct seq_file *s, void *v)
 {
-	if (*offset == 0)
-		return;
-	if (*offset >= *len) {
-		/* Not there yet */
-		*offset -= *len;
-		*len = 0;
-	} else {
-		/* We're into the interesting stuff now */
-		*start = buf + *offset;
-		*offset = 0;
-	}
-}
-
-/* FIXME: Do we need this here??  It be ugly  */
-int scullv_read_procmem(char *buf, char **start, off_t offset,
-                   int count, int *eof, void *data)
-{
-	int i, j, order, qset, len = 0;
-	int limit = count - 80; /* Don't print more than this */
+	int i, j, order, qset;
 	struct scullv_dev *d;
 
-	*start = buf;
 	for(i = 0; i < scullv_devs; i++) {
 		d = &scullv_devices[i];
 		if (down_interruptible (&d->sem))
 			return -ERESTARTSYS;
 		qset = d->qset;  /* retrieve the features of each device */
 		order = d->order;
-		len += sprintf(buf+len,"\nDevice %i: qset %i, order %i, sz %li\n",
+		seq_printf(s, "\nDevice %i: qset %i, order %i, sz %li\n",
 				i, qset, order, (long)(d->size));
 		for (; d; d = d->next) { /* scan the list */
-			len += sprintf(buf+len,"  item at %p, qset at %p\n",d,d->data);
-			scullv_proc_offset (buf, start, &offset, &len);
-			if (len > limit)
-				goto out;
+			seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
 			if (d->data && !d->next) /* dump only the last item - save space */
 				for (j = 0; j < qset; j++) {
 					if (d->data[j])
-						len += sprintf(buf+len,"    % 4i:%8p\n",j,d->data[j]);
-					scullv_proc_offset (buf, start, &offset, &len);
-					if (len > limit)
-						goto out;
+						seq_printf(s, "    % 4i:%8p\n", j, d->data[j]);
 				}
 		}
-	  out:
 		up (&scullv_devices[i].sem);
-		if (len > limit)
-			break;
 	}
-	*eof = 1;
-	return len;
+	return 0;
 }
 
 #endif /* SCULLV_USE_PROC */
 
+/*
+ * The node distribution of the quanta is always reported, as it's
+ * what users need to co-locate their threads with the data.
+ */
+static const char *scullv_numa_names[] = {
+	[SCULLV_NUMA_LOCAL]      = "local",
+	[SCULLV_NUMA_INTERLEAVE] = "interleave",
+	[SCULLV_NUMA_FIXED]      = "fixed",
+};
+
+static int scullv_numa_show(struct seq_file *s, void *v)
+{
+	int i, nid;
+	struct scullv_dev *d;
+
+	for (i = 0; i < scullv_devs; i++) {
+		d = &scullv_devices[i];
+		if (down_interruptible (&d->sem))
+			return -ERESTARTSYS;
+		seq_printf(s, "scullv%i: policy %s", i,
+				scullv_numa_names[d->numa_policy]);
+		if (d->numa_policy == SCULLV_NUMA_FIXED)
+			seq_printf(s, " %i", d->numa_node);
+		for_each_node(nid)
+			seq_printf(s, " N%i=%lu", nid, d->node_quanta[nid]);
+		seq_putc(s, '\n');
+		up (&d->sem);
+	}
+	return 0;
+}
+
 /*
  * Open and close
  */
@@ -146,6 +155,43 @@ int scullv_release (struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static int scullv_numa_valid(int policy, int node)
+{
+	if (policy < SCULLV_NUMA_LOCAL || policy > SCULLV_NUMA_FIXED)
+		return 0;
+	if (policy == SCULLV_NUMA_FIXED &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return 0;
+	return 1;
+}
+
+/*
+ * Choose the node for the next quantum of "dev", according to
+ * its placement policy. Called with the device semaphore held.
+ */
+static int scullv_quantum_node(struct scullv_dev *dev)
+{
+	int node;
+
+	switch (dev->numa_policy) {
+	case SCULLV_NUMA_INTERLEAVE:
+		node = next_online_node(dev->numa_next);
+		if (node >= MAX_NUMNODES)
+			node = first_online_node;
+		dev->numa_next = node;
+		return node;
+
+	case SCULLV_NUMA_FIXED:
+		if (dev->numa_node >= 0 && dev->numa_node < nr_node_ids &&
+		    node_online(dev->numa_node))
+			return dev->numa_node;
+		return numa_node_id(); /* a bogus node: place it locally */
+
+	default:
+		return numa_node_id();
+	}
+}
+
 /*
  * Follow the list 
  */
@@ -153,8 +199,9 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 {
 	while (n--) {
 		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullv_dev));
+			dev->next = kzalloc(sizeof(struct scullv_dev), GFP_KERNEL);
+			if (!dev->next)
+				return NULL;
 		}
 		dev = dev->next;
 		continue;
@@ -191,7 +238,7 @@ ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullv_follow(dev, item);
 
-	if (!dptr->data)
+	if (!dptr || !dptr->data)
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
@@ -235,6 +282,8 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 
 	/* follow the list up to the right position */
 	dptr = scullv_follow(dev, item);
+	if (!dptr)
+		goto nomem;
 	if (!dptr->data) {
 		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
 		if (!dptr->data)
@@ -243,10 +292,13 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Allocate a quantum using virtual addresses */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
+		dptr->data[s_pos] = vmalloc_node(quantum,
+				scullv_quantum_node(dev));
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
+		/* pages may come from several nodes: count the first one */
+		dev->node_quanta[page_to_nid(vmalloc_to_page(dptr->data[s_pos]))]++;
+		memset(dptr->data[s_pos], 0, quantum);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -271,10 +323,11 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
  * The ioctl() implementation
  */
 
-int scullv_ioctl (struct inode *inode, struct file *filp,
-                 unsigned int cmd, unsigned long arg)
+long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
+	struct scullv_dev *dev = filp->private_data;
+	struct scullv_numa numa;
 	int err = 0, ret = 0, tmp;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
@@ -282,15 +335,12 @@ int scullv_ioctl (struct inode *inode, struct file *filp,
 	if (_IOC_NR(cmd) > SCULLV_IOC_MAXNR) return -ENOTTY;
 
 	/*
-	 * the type is a bitmask, and VERIFY_WRITE catches R/W
-	 * transfers. Note that the type is user-oriented, while
-	 * verify_area is kernel-oriented, so the concept of "read" and
-	 * "write" is reversed
+	 * access_ok() no longer takes a direction: it only checks that
+	 * the range is in user space, which is all the __get_user and
+	 * __put_user calls below need
 	 */
-	if (_IOC_DIR(cmd) & _IOC_READ)
-		err = !access_ok(VERIFY_WRITE, (void __user *)arg, _IOC_SIZE(cmd));
-	else if (_IOC_DIR(cmd) & _IOC_WRITE)
-		err =  !access_ok(VERIFY_READ, (void __user *)arg, _IOC_SIZE(cmd));
+	if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE))
+		err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
 	if (err)
 		return -EFAULT;
 
@@ -355,6 +405,34 @@ int scullv_ioctl (struct inode *inode, struct file *filp,
 		scullv_qset = arg;
 		return tmp;
 
+	/*
+	 * Placement only affects quanta allocated from now on;
+	 * the ones already there stay where they are.
+	 */
+	case SCULLV_IOCSNUMA:
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+			return -EFAULT;
+		if (!scullv_numa_valid(numa.policy, numa.node))
+			return -EINVAL;
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		dev->numa_policy = numa.policy;
+		dev->numa_node = numa.node;
+		up (&dev->sem);
+		break;
+
+	case SCULLV_IOCGNUMA:
+		if (down_interruptible (&dev->sem))
+			return -ERESTARTSYS;
+		numa.policy = dev->numa_policy;
+		numa.node = dev->numa_node;
+		up (&dev->sem);
+		if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+			return -EFAULT;
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -393,69 +471,6 @@ loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
 }
 
 
-/*
- * A simple asynchronous I/O implementation.
- */
-
-struct async_work {
-	struct kiocb *iocb;
-	int result;
-	struct work_struct work;
-};
-
-/*
- * "Complete" an asynchronous operation.
- */
-static void scullv_do_deferred_op(void *p)
-{
-	struct async_work *stuff = (struct async_work *) p;
-	aio_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
-}
-
-
-static int scullv_defer_op(int write, struct kiocb *iocb, char __user *buf,
-		size_t count, loff_t pos)
-{
-	struct async_work *stuff;
-	int result;
-
-	/* Copy now while we can access the buffer */
-	if (write)
-		result = scullv_write(iocb->ki_filp, buf, count, &pos);
-	else
-		result = scullv_read(iocb->ki_filp, buf, count, &pos);
-
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
-
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_WORK(&stuff->work, scullv_do_deferred_op, stuff);
-	schedule_delayed_work(&stuff->work, HZ/100);
-	return -EIOCBQUEUED;
-}
-
-
-static ssize_t scullv_aio_read(struct kiocb *iocb, char __user *buf, size_t count,
-		loff_t pos)
-{
-	return scullv_defer_op(0, iocb, buf, count, pos);
-}
-
-static ssize_t scullv_aio_write(struct kiocb *iocb, const char __user *buf,
-		size_t count, loff_t pos)
-{
-	return scullv_defer_op(1, iocb, (char __user *) buf, count, pos);
-}
-
-
- 
 /*
  * Mmap *is* available, but confined in a different file
  */
@@ -471,12 +486,10 @@ struct file_operations scullv_fops = {
 	.llseek =    scullv_llseek,
 	.read =	     scullv_read,
 	.write =     scullv_write,
-	.ioctl =     scullv_ioctl,
+	.unlocked_ioctl = scullv_ioctl,
 	.mmap =	     scullv_mmap,
 	.open =	     scullv_open,
 	.release =   scullv_release,
-	.aio_read =  scullv_aio_read,
-	.aio_write = scullv_aio_write,
 };
 
 int scullv_trim(struct scullv_dev *dev)
@@ -505,6 +518,9 @@ int scullv_trim(struct scullv_dev *dev)
 	dev->qset = scullv_qset;
 	dev->order = scullv_order;
 	dev->next = NULL;
+	if (dev->node_quanta)
+		memset(dev->node_quanta, 0,
+				nr_node_ids * sizeof(*dev->node_quanta));
 	return 0;
 }
 
@@ -546,6 +562,12 @@ int scullv_init(void)
 		return result;
 
 	
+	if (!scullv_numa_valid(scullv_numa_policy, scullv_numa_node)) {
+		printk(KERN_WARNING "scullv: bad numa policy %d/node %d, using local\n",
+				scullv_numa_policy, scullv_numa_node);
+		scullv_numa_policy = SCULLV_NUMA_LOCAL;
+	}
+
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -559,16 +581,32 @@ int scullv_init(void)
 	for (i = 0; i < scullv_devs; i++) {
 		scullv_devices[i].order = scullv_order;
 		scullv_devices[i].qset = scullv_qset;
+		scullv_devices[i].numa_policy = scullv_numa_policy;
+		scullv_devices[i].numa_node = scullv_numa_node;
+		scullv_devices[i].numa_next = NUMA_NO_NODE;
+		scullv_devices[i].node_quanta = kcalloc(nr_node_ids,
+				sizeof(unsigned long), GFP_KERNEL);
+		if (!scullv_devices[i].node_quanta) {
+			result = -ENOMEM;
+			goto fail_numa;
+		}
 		sema_init (&scullv_devices[i].sem, 1);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
 
 #ifdef SCULLV_USE_PROC /* only when available */
-	create_proc_read_entry("scullvmem", 0, NULL, scullv_read_procmem, NULL);
+	proc_create_single("scullvmem", 0, NULL, scullv_proc_show);
 #endif
+	proc_create_single("scullvnuma", 0, NULL, scullv_numa_show);
 	return 0; /* succeed */
 
+  fail_numa:
+	while (--i >= 0) {
+		cdev_del(&scullv_devices[i].cdev);
+		kfree(scullv_devices[i].node_quanta);
+	}
+	kfree(scullv_devices);
   fail_malloc:
 	unregister_chrdev_region(dev, scullv_devs);
 	return result;
@@ -583,10 +621,12 @@ void scullv_cleanup(void)
 #ifdef SCULLV_USE_PROC
 	remove_proc_entry("scullvmem", NULL);
 #endif
+	remove_proc_entry("scullvnuma", NULL);
 
 	for (i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
 		scullv_trim(scullv_devices + i);
+		kfree(scullv_devices[i].node_quanta);
 	}
 	kfree(scullv_devices);
 	unregister_chrdev_region(MKDEV (scullv_major, 0), scullv_devs);
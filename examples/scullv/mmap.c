@@ -15,15 +15,23 @@
  * $Id: _mmap.c.in,v 1.13 2004/10/18 18:07:36 corbet Exp $
  */
 
-#include <linux/config.h>
 #include <linux/module.h>
-
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
 #include <linux/mm.h>		/* everything */
+#include <linux/vmalloc.h>	/* vmalloc_to_page() */
 #include <linux/errno.h>	/* error codes */
 #include <asm/pgtable.h>
 
 #include "scullv.h"		/* local definitions */
 
+/*
+ * Map all the data at mmap time, rather than one page per fault.
+ * It can be turned off at run time to compare the two.
+ */
+static int scullv_prepopulate = 1;
+module_param(scullv_prepopulate, int, S_IRUGO | S_IWUSR);
+
 
 /*
  * open and close: just keep track of how many times the device is
@@ -45,57 +53,84 @@ void scullv_vma_close(struct vm_area_struct *vma)
 }
 
 /*
- * The nopage method: the core of the file. It retrieves the
- * page required from the scullv device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
- *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * Return the page at page offset "pgoff" of the device, or NULL if
+ * it falls in a hole or past the end of data. Each quantum is a
+ * separate vmalloc area of 1 << order pages.
  */
-
-struct page *scullv_vma_nopage(struct vm_area_struct *vma,
-                                unsigned long address, int *type)
+static struct page *scullv_find_page(struct scullv_dev *dev,
+		unsigned long pgoff)
 {
-	unsigned long offset;
-	struct scullv_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NOPAGE_SIGBUS;
-	void *pageptr = NULL; /* default to "missing" */
-
-	down(&dev->sem);
-	offset = (address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the scullv device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
+	unsigned long quantum = pgoff >> dev->order;
+	unsigned long item = quantum / dev->qset;
+	struct scullv_dev *ptr;
+	void *pageptr = NULL;
+
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		return NULL; /* out of range */
+	for (ptr = dev; ptr && item; item--)
 		ptr = ptr->next;
-		offset -= dev->qset;
-	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-
+	if (ptr && ptr->data)
+		pageptr = ptr->data[quantum % dev->qset];
+	if (!pageptr)
+		return NULL;
 	/*
-	 * After scullv lookup, "page" is now the address of the page
-	 * needed by the current process. Since it's a vmalloc address,
-	 * turn it into a struct page.
+	 * It's a vmalloc address: turn the right page of the quantum
+	 * into a struct page.
 	 */
-	page = vmalloc_to_page(pageptr);
+	pageptr += (pgoff & ((1UL << dev->order) - 1)) << PAGE_SHIFT;
+	return vmalloc_to_page(pageptr);
+}
 
-	/* got it, now increment the count */
-	get_page(page);
-	if (type)
-		*type = VM_FAULT_MINOR;
-  out:
+/*
+ * The fault method. With scullv_prepopulate, it only runs for pages
+ * that were holes (or past the end) at mmap time. If the device has
+ * holes, the process receives a SIGBUS when accessing the hole.
+ */
+static vm_fault_t scullv_vma_fault(struct vm_fault *vmf)
+{
+	struct scullv_dev *dev = vmf->vma->vm_private_data;
+	struct page *page;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+
+	down(&dev->sem);
+	page = scullv_find_page(dev, vmf->pgoff);
+	if (page)
+		ret = vmf_insert_page(vmf->vma, vmf->address & PAGE_MASK, page);
 	up(&dev->sem);
-	return page;
+	return ret;
+}
+
+/*
+ * Map every page the device has in one walk of the quantum-set list,
+ * so that neither the first touch nor MAP_POPULATE go through "fault".
+ * vm_insert_page takes a reference on each page, dropped at unmap.
+ */
+static int scullv_populate(struct vm_area_struct *vma, struct scullv_dev *dev)
+{
+	unsigned long last = (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned long pgoff, quantum, item = 0;
+	struct scullv_dev *ptr = dev;
+	void *pageptr;
+	int err;
+
+	last = min(last, vma->vm_pgoff + vma_pages(vma));
+	for (pgoff = vma->vm_pgoff; pgoff < last; pgoff++) {
+		quantum = pgoff >> dev->order;
+		for (; ptr && item < quantum / dev->qset; item++)
+			ptr = ptr->next;
+		if (!ptr)
+			break; /* the rest is past the end of the list */
+		if (!ptr->data || !ptr->data[quantum % dev->qset])
+			continue; /* a hole: leave it to "fault" */
+		pageptr = ptr->data[quantum % dev->qset] +
+			((pgoff & ((1UL << dev->order) - 1)) << PAGE_SHIFT);
+		err = vm_insert_page(vma, vma->vm_start +
+				((pgoff - vma->vm_pgoff) << PAGE_SHIFT),
+				vmalloc_to_page(pageptr));
+		if (err)
+			return err;
+	}
+	return 0;
 }
 
 
@@ -103,17 +138,27 @@ struct page *scullv_vma_nopage(struct vm_area_struct *vma,
 struct vm_operations_struct scullv_vm_ops = {
 	.open =     scullv_vma_open,
 	.close =    scullv_vma_close,
-	.nopage =   scullv_vma_nopage,
+	.fault =    scullv_vma_fault,
 };
 
 
 int scullv_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+	struct scullv_dev *dev = filp->private_data;
+	int err = 0;
 
-	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &scullv_vm_ops;
-	vma->vm_flags |= VM_RESERVED;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = dev;
+
+	if (scullv_prepopulate) {
+		if (down_interruptible(&dev->sem))
+			return -ERESTARTSYS;
+		err = scullv_populate(vma, dev);
+		up(&dev->sem);
+		if (err)
+			return err; /* the vma is torn down, pages and all */
+	}
 	scullv_vma_open(vma);
 	return 0;
 }
@@ -15,6 +15,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/semaphore.h>
 
 /*
  * Macros to help debugging
@@ -52,6 +53,18 @@
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
 
+/*
+ * Where the quanta are placed on NUMA machines.
+ */
+#define SCULLV_NUMA_LOCAL      0	/* node of the writing CPU */
+#define SCULLV_NUMA_INTERLEAVE 1	/* round-robin over the online nodes */
+#define SCULLV_NUMA_FIXED      2	/* always the node set with the policy */
+
+struct scullv_numa {
+	int policy;               /* one of SCULLV_NUMA_* */
+	int node;                 /* only used by SCULLV_NUMA_FIXED */
+};
+
 struct scullv_dev {
 	void **data;
 	struct scullv_dev *next;  /* next listitem */
@@ -59,6 +72,10 @@ struct scullv_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int numa_policy;          /* quantum placement, SCULLV_NUMA_* */
+	int numa_node;            /* target node for SCULLV_NUMA_FIXED */
+	int numa_next;            /* last node used when interleaving */
+	unsigned long *node_quanta; /* quanta on each node (first item only) */
 	struct semaphore sem;     /* Mutual exclusion */
 	struct cdev cdev;
 };
@@ -74,6 +91,8 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_numa_policy;
+extern int scullv_numa_node;
 
 /*
  * Prototypes for shared functions
@@ -116,7 +135,13 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
 #define SCULLV_IOCXQSET    _IOWR(SCULLV_IOC_MAGIC,11, int)
 #define SCULLV_IOCHQSET    _IO(SCULLV_IOC_MAGIC,  12)
 
-#define SCULLV_IOC_MAXNR 12
+/*
+ * NUMA placement of the quanta, per device.
+ */
+#define SCULLV_IOCSNUMA    _IOW(SCULLV_IOC_MAGIC, 13, struct scullv_numa)
+#define SCULLV_IOCGNUMA    _IOR(SCULLV_IOC_MAGIC, 14, struct scullv_numa)
+
+#define SCULLV_IOC_MAXNR 14
 
 
 